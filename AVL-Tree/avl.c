@@ -9,179 +9,2229 @@
  * values.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "avl.h"
 #include "bstnode.h"
+#include "taskpool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Evaluates to the maximum of two values */
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/** Number of spaces to indent tree levels */
+#define INDENT 5
+
+#ifdef AVL_STATS
+/** Adds n to one of the tree's counters */
+#define STAT_ADD(tree, counter, n) \
+    atomic_fetch_add_explicit(&(tree)->counters.counter, (n), \
+                              memory_order_relaxed)
+/** Records a search that compared the key against depth nodes */
+#define STAT_SEARCH(tree, depth) record_search((tree), (depth), (depth))
+/** Records a search that reached depth nodes but made fewer comparisons */
+#define STAT_WALK(tree, depth, compared) \
+    record_search((tree), (depth), (compared))
+#else
+#define STAT_ADD(tree, counter, n) ((void) (n))
+#define STAT_SEARCH(tree, depth) ((void) (depth))
+#define STAT_WALK(tree, depth, compared) ((void) (depth), (void) (compared))
+#endif
+
+/** Number of descents lookup_avl_many keeps in flight */
+#define LOOKUP_LANES 16
+
+#ifdef __GNUC__
+/** Hints the processor to start loading the given address */
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void) 0)
+#endif
+
+/** Number of nodes per slab when the caller does not pick a size */
+#define DEFAULT_SLAB_NODES 4096
+
+/**
+ * Subtrees with fewer nodes than this are not worth handing to another
+ * thread during parallel builds and set operations.
+ */
+#define PARALLEL_GRAIN 8192
+
+/** Nodes the background reclaimer frees between checks of the queue */
+#define RECLAIM_CHUNK 65536
+
+
+/**
+ * One key/value pair from a batch insertion. The position in the batch
+ * breaks ties between repeated keys so that the last one wins.
+ */
+typedef struct BatchEntry {
+    /** Key to insert */
+    int key;
+    /** Value to insert */
+    void *value;
+    /** Index of this pair in the caller's arrays */
+    size_t index;
+} BatchEntry;
+
+/**
+ * Work for one subtree of a balanced build. The root of the subtree is
+ * stored back into the job, so jobs can be run as tasks.
+ */
+typedef struct BuildJob {
+    /** Pool to spread the work over, or NULL to work sequentially */
+    TaskPool *workers;
+    /** Storage for every node of the tree, in key order */
+    BSTNode *nodes;
+    /** Sorted array of keys */
+    const int *keys;
+    /** Values matching the keys, or NULL */
+    void **values;
+    /** Index of the first key in the subtree */
+    size_t lo;
+    /** Index one past the last key in the subtree */
+    size_t hi;
+    /** Set to the root of the built subtree */
+    BSTNode *root;
+} BuildJob;
+
+/** Set operations that can be run with set_op */
+typedef enum SetOp { SET_UNION, SET_INTERSECT, SET_DIFFERENCE } SetOp;
+
+/**
+ * Nodes dropped by a set operation, chained through their right
+ * pointers. They are released only once every thread is done, since the
+ * pool allocator is not thread safe.
+ */
+typedef struct NodeList {
+    /** First node in the list */
+    BSTNode *head;
+    /** Last node in the list */
+    BSTNode *tail;
+} NodeList;
+
+/**
+ * A set operation on a pair of subtrees. The result is stored back into
+ * the job, so jobs can be run as tasks.
+ */
+typedef struct SetJob {
+    /** Operation to perform */
+    SetOp op;
+    /** Pool to spread the work over, or NULL to work sequentially */
+    TaskPool *workers;
+    /** Root of the subtree from the first tree */
+    BSTNode *a;
+    /** Root of the subtree from the second tree */
+    BSTNode *b;
+    /** Set to the root of the combined subtree */
+    BSTNode *result;
+    /** Nodes that are not part of the result */
+    NodeList dropped;
+} SetJob;
+
+/**
+ * One slot of the lookup cache. Readers of a concurrent tree fill slots
+ * while other readers probe them, so each slot is guarded by a sequence
+ * number in the manner of a seqlock: it is odd while the slot is being
+ * written, and a probe that sees it change discards what it read. Slots
+ * hold nodes rather than values, so a value changed in place never goes
+ * stale here, and only removing a node has to clear its slot.
+ */
+typedef struct CacheEntry {
+    /** Bumped before and after every change to the slot */
+    atomic_uint seq;
+    /** Key cached in this slot */
+    atomic_int key;
+    /** Node holding the key, or NULL if the slot is empty */
+    _Atomic(BSTNode *) node;
+} CacheEntry;
+
+/** Defined in avl.h */
+struct AVLCache {
+    /** Number of slots minus one, for masking hashes */
+    size_t mask;
+    /** Number of bits to drop from a 32-bit hash */
+    int shift;
+    /** The slots */
+    CacheEntry entries[];
+};
+
+/**
+ * Nodes of a tree handed to avl_free_async that are still to be freed.
+ */
+typedef struct Reclaim {
+    /** Next tree in the queue */
+    struct Reclaim *next;
+    /** Where the walk over a tree without an arena resumes */
+    BSTNode *node;
+    /** Arena holding every node of the tree, or NULL */
+    NodePool *pool;
+} Reclaim;
+
+/** Guards the reclaim queue */
+static pthread_mutex_t reclaimLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signalled when a tree is queued for reclaiming */
+static pthread_cond_t reclaimQueued = PTHREAD_COND_INITIALIZER;
+
+/** Trees waiting to be freed, not counting any a thread is working on */
+static Reclaim *reclaimQueue;
+
+/** Whether the background reclaimer is running */
+static bool reclaimRunning;
+
+/**
+ * A walk over one subtree for avl_parallel_for_each. Apart from the root,
+ * every job of a walk shares the same fields, so subtrees can be walked
+ * as tasks.
+ */
+typedef struct WalkJob {
+    /** Pool to spread the work over, or NULL to work sequentially */
+    TaskPool *workers;
+    /** Function to call for each node */
+    AVLVisitor fn;
+    /** Context pointer passed to fn */
+    void *ctx;
+    /** Root of the subtree to walk */
+    BSTNode *root;
+    /** Set once fn asks to stop */
+    atomic_bool *stop;
+    /** Number of nodes fn was called for */
+    atomic_size_t *visited;
+} WalkJob;
+
+/**
+ * A fold of one subtree for avl_reduce. The subtree is folded into acc,
+ * so jobs can be run as tasks.
+ */
+typedef struct ReduceJob {
+    /** Pool to spread the work over, or NULL to work sequentially */
+    TaskPool *workers;
+    /** How to fold the nodes */
+    const AVLReducer *reducer;
+    /** Context pointer passed to the reducer */
+    void *ctx;
+    /** Root of the subtree to fold */
+    BSTNode *root;
+    /** Accumulator the subtree is folded into */
+    void *acc;
+} ReduceJob;
+
+/**
+ * Lock shared by the threads using a concurrent tree. Defined here so
+ * that avl.h does not need to pull in pthread.h.
+ */
+struct AVLLock {
+    /** Held shared by readers and exclusively by writers */
+    pthread_rwlock_t rwlock;
+};
+
+/* Static function prototypes */
+static void writeLock(AVLTree *tree);
+static AVLCache *createCache(size_t slots);
+static CacheEntry *cache_slot(const AVLCache *cache, int key);
+static void cache_fill(AVLCache *cache, BSTNode *node);
+static void cache_forget(AVLTree *tree, int key);
+static void cache_clear(AVLTree *tree);
+static int height(BSTNode *node);
+static size_t size(BSTNode *node);
+static BSTNode *newNode(AVLTree *tree);
+static void setValue(AVLTree *tree, BSTNode *node, void *value);
+static void releaseNode(AVLTree *tree, BSTNode *node);
+static void freeNode(BSTNode *node);
+static BSTNode *freeNodes(BSTNode *node, size_t *budget);
+static bool reclaim(Reclaim *entry, size_t *budget);
+static void *reclaim_loop(void *arg);
+static void build_balanced(void *arg);
+static TaskPool *startWorkers(int threads, size_t n);
+static BSTNode *link_balanced(BSTNode **nodes, size_t lo, size_t hi);
+static bool insert_node(AVLTree *tree, int key, void *value);
+static BSTNode *place_node(AVLTree *tree, int key, void *value,
+                           bool *created);
+static int compare_entries(const void *a, const void *b);
+static bool merge_batch(AVLTree *tree, const BatchEntry *batch, size_t n);
+static void *delete_node(AVLTree *tree, int key);
+static BSTNode *rebalance(AVLTree *tree, BSTNode *root);
+static void retrace(AVLTree *tree, BSTNode **path[], int depth, bool grew);
+static BSTNode *lookup(int key, AVLTree *tree);
+static size_t count_below(int key, bool inclusive, BSTNode *tree);
+static void descend(AVLIter *iter, BSTNode *node, bool leftmost);
+static void walk_subtree(void *arg);
+static void reduce_subtree(void *arg);
+static BSTNode *rotateRight(BSTNode *node);
+static BSTNode *rotateLeft(BSTNode *node);
+static bool matching(AVLTree *a, AVLTree *b);
+static void lockPair(AVLTree *a, AVLTree *b);
+static void unlockPair(AVLTree *a, AVLTree *b);
+static bool set_operation(AVLTree *a, AVLTree *b, int threads, SetOp op);
+static void set_op(void *arg);
+static void drop_node(NodeList *list, BSTNode *node);
+static void drop_tree(NodeList *list, BSTNode *node);
+static void append_list(NodeList *list, const NodeList *more);
+static void update(BSTNode *node);
+static BSTNode *join(BSTNode *left, BSTNode *mid, BSTNode *right);
+static BSTNode *join_right(BSTNode *left, BSTNode *mid, BSTNode *right);
+static BSTNode *join_left(BSTNode *left, BSTNode *mid, BSTNode *right);
+static BSTNode *join2(BSTNode *left, BSTNode *right);
+static BSTNode *split(BSTNode *root, int key, BSTNode **left,
+                      BSTNode **right);
+static BSTNode *split_last(BSTNode *root, BSTNode **last);
+static BSTNode *relocate_nodes(AVLTree *tree, char *slots, size_t stride);
+#ifdef AVL_STATS
+static void record_search(AVLTree *tree, size_t depth, size_t compared);
+#endif
+static void print_nodes(BSTNode *root, int indent);
+
+/** Documented in avl.h */
+AVLTree *createAVLTree() {
+    return createAVLTreeWithOptions(NULL);
+}
+
+/** Documented in avl.h */
+AVLTree *createAVLTreeWithArena(size_t slabNodes) {
+    AVLTreeOptions options = { .arena = true, .slabNodes = slabNodes };
+    return createAVLTreeWithOptions(&options);
+}
+
+/** Documented in avl.h */
+AVLTree *createConcurrentAVLTree() {
+    AVLTreeOptions options = { .concurrent = true };
+    return createAVLTreeWithOptions(&options);
+}
+
+/** Documented in avl.h */
+AVLTree *createAVLTreeWithOptions(const AVLTreeOptions *options) {
+    AVLTreeOptions defaults = { .arena = false };
+    if (options == NULL) {
+        options = &defaults;
+    }
+
+    AVLTree *tree = malloc(sizeof(AVLTree));
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->root = NULL;
+    tree->pool = NULL;
+    tree->count = 0;
+    tree->lock = NULL;
+    tree->valueSize = options->valueSize;
+    tree->maxImbalance = options->maxImbalance;
+    if (tree->maxImbalance < 1) {
+        tree->maxImbalance = 1;
+    } else if (tree->maxImbalance > AVL_MAX_IMBALANCE) {
+        tree->maxImbalance = AVL_MAX_IMBALANCE;
+    }
+    tree->cache = NULL;
+#ifdef AVL_STATS
+    atomic_init(&tree->counters.comparisons, 0);
+    atomic_init(&tree->counters.singleRotations, 0);
+    atomic_init(&tree->counters.doubleRotations, 0);
+    atomic_init(&tree->counters.searches, 0);
+    atomic_init(&tree->counters.depthTotal, 0);
+    atomic_init(&tree->counters.maxDepth, 0);
+#endif
+
+    if (options->arena) {
+        size_t slabNodes = options->slabNodes;
+        if (slabNodes == 0) {
+            slabNodes = DEFAULT_SLAB_NODES;
+        }
+        tree->pool = createNodePool(sizeof(BSTNode) + tree->valueSize,
+                                    slabNodes);
+        if (tree->pool == NULL) {
+            freeTree(tree);
+            return NULL;
+        }
+    }
+
+    if (options->concurrent) {
+        tree->lock = malloc(sizeof(AVLLock));
+        if (tree->lock == NULL) {
+            freeTree(tree);
+            return NULL;
+        }
+        if (pthread_rwlock_init(&tree->lock->rwlock, NULL) != 0) {
+            free(tree->lock);
+            tree->lock = NULL;
+            freeTree(tree);
+            return NULL;
+        }
+    }
+
+    if (options->cacheSlots > 0) {
+        tree->cache = createCache(options->cacheSlots);
+        if (tree->cache == NULL) {
+            freeTree(tree);
+            return NULL;
+        }
+    }
+    return tree;
+}
+
+/**
+ * Allocates an empty lookup cache.
+ *
+ * @param slots minimum number of slots
+ *
+ * @return pointer to the cache, or NULL if allocation fails
+ */
+static AVLCache *createCache(size_t slots) {
+    size_t count = 1;
+    int shift = 32;
+    while (count < slots && shift > 1) {
+        count <<= 1;
+        shift--;
+    }
+    AVLCache *cache = malloc(sizeof(AVLCache) + count * sizeof(CacheEntry));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->mask = count - 1;
+    cache->shift = shift;
+    for (size_t i = 0; i < count; i++) {
+        atomic_init(&cache->entries[i].seq, 0);
+        atomic_init(&cache->entries[i].key, 0);
+        atomic_init(&cache->entries[i].node, NULL);
+    }
+    return cache;
+}
+
+/** Documented in avl.h */
+AVLTree *avl_build_from_sorted(const int *keys, void **values, size_t n) {
+    return avl_build_from_sorted_parallel(keys, values, n, 1);
+}
+
+/** Documented in avl.h */
+AVLTree *avl_build_from_sorted_parallel(const int *keys, void **values,
+                                        size_t n, int threads) {
+    for (size_t i = 1; i < n; i++) {
+        if (keys[i - 1] >= keys[i]) {
+            return NULL;
+        }
+    }
+
+    AVLTree *tree = createAVLTreeWithArena(0);
+    if (tree == NULL || n == 0) {
+        return tree;
+    }
+    BSTNode *nodes = pool_alloc_array(tree->pool, n);
+    if (nodes == NULL) {
+        freeTree(tree);
+        return NULL;
+    }
+
+    BuildJob job = { .workers = startWorkers(threads, n), .nodes = nodes,
+                     .keys = keys, .values = values, .lo = 0, .hi = n };
+    build_balanced(&job);
+    freeTaskPool(job.workers);
+    tree->root = job.root;
+    tree->count = n;
+    return tree;
+}
+
+/**
+ * Builds a balanced subtree from keys[lo..hi) of a BuildJob. The middle
+ * key becomes the root, so the two halves differ in size by at most one.
+ * Each key goes in the node at the same index, which keeps the nodes in
+ * key order in memory. Large halves are built on separate threads.
+ *
+ * @param *arg the BuildJob describing the subtree
+ */
+static void build_balanced(void *arg) {
+    BuildJob *job = arg;
+    if (job->lo == job->hi) {
+        job->root = NULL;
+        return;
+    }
+    size_t mid = job->lo + (job->hi - job->lo) / 2;
+    BuildJob left = *job;
+    BuildJob right = *job;
+    left.hi = mid;
+    right.lo = mid + 1;
+    if (job->workers && job->hi - job->lo > PARALLEL_GRAIN) {
+        Task task;
+        task_spawn(job->workers, &task, build_balanced, &left);
+        build_balanced(&right);
+        task_wait(job->workers, &task);
+    } else {
+        build_balanced(&left);
+        build_balanced(&right);
+    }
+
+    BSTNode *node = &job->nodes[mid];
+    *node = (BSTNode) { .key = job->keys[mid],
+                        .value = job->values ? job->values[mid] : NULL,
+                        .left = left.root, .right = right.root,
+                        .height = 1 + MAX(height(left.root),
+                                          height(right.root)),
+                        .size = 1 + size(left.root) + size(right.root) };
+    job->root = node;
+}
+
+/**
+ * Starts the workers for a parallel operation on n nodes, unless it is
+ * too small to be worth splitting up.
+ *
+ * @param threads number of threads the caller asked for, counting itself
+ * @param n number of nodes the operation touches
+ *
+ * @return pointer to a pool, or NULL if the work should be done on the
+ * calling thread alone
+ */
+static TaskPool *startWorkers(int threads, size_t n) {
+    if (threads <= 1 || n <= PARALLEL_GRAIN) {
+        return NULL;
+    }
+    return createTaskPool(threads - 1);
+}
+
+/** Documented in avl.h */
+void freeTree(AVLTree *tree) {
+    if (tree == NULL) {
+        return;
+    }
+    if (tree->pool) {
+        // Every node lives in the pool, so release the slabs in bulk
+        freeNodePool(tree->pool);
+    } else {
+        freeNode(tree->root);
+    }
+    if (tree->lock) {
+        pthread_rwlock_destroy(&tree->lock->rwlock);
+        free(tree->lock);
+    }
+    free(tree->cache);
+    free(tree);
+}
+
+/** Documented in avl.h */
+void avl_read_lock(AVLTree *tree) {
+    if (tree && tree->lock) {
+        pthread_rwlock_rdlock(&tree->lock->rwlock);
+    }
+}
+
+/** Documented in avl.h */
+void avl_unlock(AVLTree *tree) {
+    if (tree && tree->lock) {
+        pthread_rwlock_unlock(&tree->lock->rwlock);
+    }
+}
+
+/**
+ * Takes the write lock of a concurrent tree, excluding every reader and
+ * other writer. Does nothing for other trees. Released with avl_unlock.
+ *
+ * @param *tree the tree to lock
+ */
+static void writeLock(AVLTree *tree) {
+    if (tree->lock) {
+        pthread_rwlock_wrlock(&tree->lock->rwlock);
+    }
+}
+
+/**
+ * Allocates storage for a node, from the tree's pool if it has one.
+ *
+ * @param *tree the tree the node will belong to
+ *
+ * @return pointer to an uninitialized node, or NULL if allocation fails
+ */
+static BSTNode *newNode(AVLTree *tree) {
+    if (tree->pool) {
+        return pool_alloc(tree->pool);
+    }
+    return malloc(sizeof(BSTNode) + tree->valueSize);
+}
+
+/**
+ * Stores a value in a node. Trees with inline values copy the bytes into
+ * the space after the node and point the value field at the copy.
+ *
+ * @param *tree the tree the node belongs to
+ * @param *node the node to store the value in
+ * @param *value the value given by the caller
+ */
+static void setValue(AVLTree *tree, BSTNode *node, void *value) {
+    if (tree->valueSize == 0) {
+        node->value = value;
+        return;
+    }
+    node->value = node + 1;
+    if (value) {
+        memcpy(node->value, value, tree->valueSize);
+    } else {
+        memset(node->value, 0, tree->valueSize);
+    }
+}
+
+/**
+ * Releases a node that has been unlinked from the tree, returning it to
+ * the tree's pool if it has one.
+ *
+ * @param *tree the tree the node belonged to
+ * @param *node the node to release
+ */
+static void releaseNode(AVLTree *tree, BSTNode *node) {
+    if (tree->pool) {
+        pool_release(tree->pool, node);
+    } else {
+        free(node);
+    }
+}
+
+/**
+ * Frees every node in the subtree without recursing.
+ *
+ * @param node pointer to the root node of the subtree to free
+ */
+static void freeNode(BSTNode *node) {
+    size_t unlimited = SIZE_MAX;
+    freeNodes(node, &unlimited);
+}
+
+/**
+ * Frees nodes of a subtree, stopping once the budget runs out. Whenever
+ * the current node has a left child, a right rotation lifts that child
+ * above it; once there is no left child, the node is freed and the walk
+ * continues down the right. This needs no stack, so it is safe for
+ * subtrees of any shape, and the walk can stop and resume at any node.
+ *
+ * @param node pointer to the root node of the subtree to free
+ * @param *budget number of rotations and frees that may be done, reduced
+ *      by the number done
+ *
+ * @return the node to resume from, or NULL once every node is freed
+ */
+static BSTNode *freeNodes(BSTNode *node, size_t *budget) {
+    while (node && *budget > 0) {
+        if (node->left) {
+            BSTNode *left = node->left;
+            node->left = left->right;
+            left->right = node;
+            node = left;
+        } else {
+            BSTNode *right = node->right;
+            free(node);
+            node = right;
+        }
+        --*budget;
+    }
+    return node;
+}
+
+/** Documented in avl.h */
+void avl_free_async(AVLTree *tree) {
+    if (tree == NULL) {
+        return;
+    }
+    Reclaim *entry = malloc(sizeof(Reclaim));
+    if (entry == NULL) {
+        freeTree(tree);
+        return;
+    }
+    entry->node = tree->pool ? NULL : tree->root;
+    entry->pool = tree->pool;
+    // Detach the nodes so only the tree itself is freed now
+    tree->root = NULL;
+    tree->pool = NULL;
+    freeTree(tree);
+
+    pthread_mutex_lock(&reclaimLock);
+    entry->next = reclaimQueue;
+    reclaimQueue = entry;
+    pthread_cond_signal(&reclaimQueued);
+    pthread_mutex_unlock(&reclaimLock);
+}
+
+/** Documented in avl.h */
+bool avl_reclaim_step(size_t budget) {
+    pthread_mutex_lock(&reclaimLock);
+    while (budget > 0 && reclaimQueue) {
+        // Work on the tree unlocked, so avl_free_async never waits on it
+        Reclaim *entry = reclaimQueue;
+        reclaimQueue = entry->next;
+        pthread_mutex_unlock(&reclaimLock);
+        bool done = reclaim(entry, &budget);
+        pthread_mutex_lock(&reclaimLock);
+        if (!done) {
+            entry->next = reclaimQueue;
+            reclaimQueue = entry;
+        }
+    }
+    bool more = reclaimQueue != NULL;
+    pthread_mutex_unlock(&reclaimLock);
+    return more;
+}
+
+/** Documented in avl.h */
+bool avl_reclaim_start(void) {
+    pthread_mutex_lock(&reclaimLock);
+    if (!reclaimRunning) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, reclaim_loop, NULL) == 0) {
+            pthread_detach(thread);
+            reclaimRunning = true;
+        }
+    }
+    bool running = reclaimRunning;
+    pthread_mutex_unlock(&reclaimLock);
+    return running;
+}
+
+/**
+ * Frees part of a queued tree.
+ *
+ * @param *entry the tree to work on
+ * @param *budget number of nodes that may be freed, reduced by the
+ *      number freed
+ *
+ * @return true if the tree is now freed completely, along with the entry
+ */
+static bool reclaim(Reclaim *entry, size_t *budget) {
+    if (entry->pool) {
+        // Whole slabs go at once, so nodes need not be visited
+        if (!pool_free_step(entry->pool, budget)) {
+            return false;
+        }
+    } else {
+        entry->node = freeNodes(entry->node, budget);
+        if (entry->node) {
+            return false;
+        }
+    }
+    free(entry);
+    return true;
+}
+
+/**
+ * Body of the background reclaimer. Sleeps until a tree is queued, then
+ * frees queued trees a chunk at a time until none are left.
+ *
+ * @param *arg unused
+ */
+static void *reclaim_loop(void *arg) {
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&reclaimLock);
+        while (reclaimQueue == NULL) {
+            pthread_cond_wait(&reclaimQueued, &reclaimLock);
+        }
+        pthread_mutex_unlock(&reclaimLock);
+        while (avl_reclaim_step(RECLAIM_CHUNK)) {
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns the height field of the given node, or 0 if the node is NULL.
+ *
+ * @param *node
+ *      the node to find the height of
+ *
+ * @return the height of node n
+ */
+static int height(BSTNode *node)
+{
+    if (node == NULL) {
+        return 0;
+    }
+    return node->height;
+}
+
+/**
+ * Returns the size field of the given node, or 0 if the node is NULL.
+ *
+ * @param *node
+ *      the node to find the subtree size of
+ *
+ * @return the number of nodes in the subtree rooted at node
+ */
+static size_t size(BSTNode *node)
+{
+    if (node == NULL) {
+        return 0;
+    }
+    return node->size;
+}
+
+/** Documented in avl.h */
+bool insert_avl(int key, void *value, AVLTree *tree) {
+    if (tree == NULL) {
+        return false;
+    }
+    writeLock(tree);
+    bool ok = insert_node(tree, key, value);
+    avl_unlock(tree);
+    return ok;
+}
+
+/** Documented in avl.h */
+bool avl_upsert(AVLTree *tree, int key, void ***slot, bool *created) {
+    if (tree == NULL || slot == NULL) {
+        return false;
+    }
+    bool isNew;
+    writeLock(tree);
+    BSTNode *node = place_node(tree, key, NULL, &isNew);
+    avl_unlock(tree);
+    if (node == NULL) {
+        return false;
+    }
+    *slot = &node->value;
+    if (created) {
+        *created = isNew;
+    }
+    return true;
+}
+
+/** Documented in avl.h */
+bool avl_replace(AVLTree *tree, int key, void *value, void **old) {
+    if (tree == NULL) {
+        return false;
+    }
+    bool created;
+    writeLock(tree);
+    BSTNode *node = place_node(tree, key, value, &created);
+    void *previous = NULL;
+    if (node && !created) {
+        previous = tree->valueSize > 0 ? NULL : node->value;
+        setValue(tree, node, value);
+    }
+    avl_unlock(tree);
+    if (old) {
+        *old = previous;
+    }
+    return node != NULL;
+}
+
+/** Documented in avl.h */
+bool avl_append(AVLTree *tree, int key, void *value) {
+    if (tree == NULL) {
+        return false;
+    }
+    writeLock(tree);
+    BSTNode **path[AVL_MAX_HEIGHT];
+    int depth = 0;
+    BSTNode **link = &tree->root;
+    while (*link) {
+        path[depth++] = link;
+        link = &(*link)->right;
+    }
+    // Only the current maximum is compared against
+    STAT_WALK(tree, depth, depth > 0);
+
+    BSTNode *node = NULL;
+    if (depth == 0 || (*path[depth - 1])->key < key) {
+        node = newNode(tree);
+    }
+    if (node) {
+        *node = (BSTNode) { .height = 1, .size = 1, .key = key,
+                            .left = NULL, .right = NULL };
+        setValue(tree, node, value);
+        *link = node;
+        tree->count++;
+        retrace(tree, path, depth, true);
+    }
+    avl_unlock(tree);
+    return node != NULL;
+}
+
+/**
+ * Internal function for node insertion. Stores the value in the node
+ * holding the key, adding the node first if there is none.
+ *
+ * @param *tree the tree being inserted into
+ * @param key key to insert
+ * @param value value to insert
+ *
+ * @return true if the key was inserted or updated, false if a new node
+ * could not be allocated
+ */
+static bool insert_node(AVLTree *tree, int key, void *value) {
+    bool created;
+    BSTNode *node = place_node(tree, key, value, &created);
+    if (node && !created) {
+        setValue(tree, node, value);
+    }
+    return node != NULL;
+}
+
+/**
+ * Finds the node holding a key, or adds one. Descends from the root while
+ * recording the link to every node on the way, then after adding a node
+ * walks that path back up to update heights and rebalance. Finding the
+ * key changes no heights, so it returns without walking back up.
+ *
+ * @param *tree the tree being inserted into
+ * @param key key to find or insert
+ * @param value value to give a new node. An existing node keeps its value
+ * @param *created set to true if a node was added, false if one was found
+ *
+ * @return the node holding the key, or NULL if a new node could not be
+ * allocated
+ */
+static BSTNode *place_node(AVLTree *tree, int key, void *value,
+                           bool *created) {
+    BSTNode **path[AVL_MAX_HEIGHT];
+    int depth = 0;
+    BSTNode **link = &tree->root;
+
+    while (*link) {
+        BSTNode *node = *link;
+        if (key == node->key) {
+            break;
+        }
+        path[depth++] = link;
+        link = key < node->key ? &node->left : &node->right;
+    }
+    STAT_SEARCH(tree, depth + (*link != NULL));
+
+    *created = *link == NULL;
+    if (*link) {
+        return *link;
+    }
+
+    BSTNode *node = newNode(tree);
+    if (node == NULL) {
+        return NULL;
+    }
+    /* A leaf node gets a height of 1 and a NULL node gets a height of 0,
+        to ensure the treee remains balanced */
+    *node = (BSTNode) { .height = 1, .size = 1, .key = key,
+                        .left = NULL, .right = NULL };
+    setValue(tree, node, value);
+    *link = node;
+    tree->count++;
+
+    retrace(tree, path, depth, true);
+    return node;
+}
+
+/** Documented in avl.h */
+bool insert_avl_batch(AVLTree *tree, const int *keys, void **values,
+                      size_t n) {
+    if (tree == NULL) {
+        return false;
+    }
+    if (n == 0) {
+        return true;
+    }
+
+    BatchEntry *batch = malloc(n * sizeof(BatchEntry));
+    if (batch == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        batch[i] = (BatchEntry) { .key = keys[i], .index = i,
+                                  .value = values ? values[i] : NULL };
+    }
+    qsort(batch, n, sizeof(BatchEntry), compare_entries);
+
+    // Keep only the last value given for each key
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (unique > 0 && batch[unique - 1].key == batch[i].key) {
+            batch[unique - 1] = batch[i];
+        } else {
+            batch[unique++] = batch[i];
+        }
+    }
+
+    /* Inserting one at a time costs about log2(size) steps per key, while
+        a merge touches every node once. Merge when that is cheaper. */
+    writeLock(tree);
+    size_t total = tree->count + unique;
+    size_t depth = 1;
+    while (total >>= 1) {
+        depth++;
+    }
+    bool ok;
+    if (unique * depth >= tree->count + unique) {
+        ok = merge_batch(tree, batch, unique);
+    } else {
+        ok = true;
+        for (size_t i = 0; i < unique && ok; i++) {
+            ok = insert_node(tree, batch[i].key, batch[i].value);
+        }
+    }
+    avl_unlock(tree);
+
+    free(batch);
+    return ok;
+}
+
+/**
+ * Orders batch entries by key, then by their position in the batch.
+ *
+ * @param *a pointer to the first BatchEntry
+ * @param *b pointer to the second BatchEntry
+ *
+ * @return negative, zero or positive as a sorts before, with or after b
+ */
+static int compare_entries(const void *a, const void *b) {
+    const BatchEntry *x = a;
+    const BatchEntry *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * Merges a sorted batch of unique keys into the tree. The tree is
+ * flattened into an array of its nodes in key order, merged with the
+ * batch, and relinked into a perfectly balanced tree. New nodes are
+ * allocated before anything is changed, so the tree is left untouched if
+ * an allocation fails.
+ *
+ * @param *tree the tree to merge into
+ * @param *batch sorted array of entries with unique keys
+ * @param n number of entries in the batch
+ *
+ * @return true if the batch was merged, false if allocation failed
+ */
+static bool merge_batch(AVLTree *tree, const BatchEntry *batch, size_t n) {
+    BSTNode **nodes = malloc((tree->count + n) * sizeof(BSTNode *));
+    if (nodes == NULL) {
+        return false;
+    }
+
+    // Flatten the tree in key order, after the space for the merge
+    BSTNode **flat = nodes + n;
+    BSTNode *stack[AVL_MAX_HEIGHT];
+    int depth = 0;
+    size_t count = 0;
+    BSTNode *node = tree->root;
+    while (node || depth > 0) {
+        while (node) {
+            stack[depth++] = node;
+            node = node->left;
+        }
+        node = stack[--depth];
+        flat[count++] = node;
+        node = node->right;
+    }
+
+    // Count and allocate the nodes for keys that are not in the tree yet
+    size_t added = 0;
+    for (size_t i = 0, j = 0; i < n; i++) {
+        while (j < count && flat[j]->key < batch[i].key) {
+            j++;
+        }
+        if (j == count || flat[j]->key != batch[i].key) {
+            added++;
+        }
+    }
+    BSTNode **fresh = malloc(added * sizeof(BSTNode *) + 1);
+    if (fresh == NULL || (tree->pool && !pool_reserve(tree->pool, added))) {
+        free(fresh);
+        free(nodes);
+        return false;
+    }
+    for (size_t i = 0; i < added; i++) {
+        fresh[i] = newNode(tree);
+        if (fresh[i] == NULL) {
+            while (i > 0) {
+                releaseNode(tree, fresh[--i]);
+            }
+            free(fresh);
+            free(nodes);
+            return false;
+        }
+    }
+
+    /* Merge from the front. Each output slot is filled before the flattened
+        node stored there is needed, because the output never gets ahead
+        of the batch entries plus tree nodes consumed so far. */
+    size_t out = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+    while (i < n || j < count) {
+        if (j == count || (i < n && batch[i].key < flat[j]->key)) {
+            node = fresh[k++];
+            *node = (BSTNode) { .key = batch[i].key };
+            setValue(tree, node, batch[i].value);
+            i++;
+        } else {
+            node = flat[j++];
+            if (i < n && batch[i].key == node->key) {
+                setValue(tree, node, batch[i++].value);
+            }
+        }
+        nodes[out++] = node;
+    }
+
+    tree->root = link_balanced(nodes, 0, out);
+    tree->count = out;
+    cache_clear(tree);
+    free(fresh);
+    free(nodes);
+    return true;
+}
+
+/**
+ * Relinks nodes[lo..hi), which are in key order, into a perfectly
+ * balanced subtree, resetting their child pointers and heights.
+ *
+ * @param **nodes array of nodes in key order
+ * @param lo index of the first node in the subtree
+ * @param hi index one past the last node in the subtree
+ *
+ * @return pointer to the root of the subtree
+ */
+static BSTNode *link_balanced(BSTNode **nodes, size_t lo, size_t hi) {
+    if (lo == hi) {
+        return NULL;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    BSTNode *node = nodes[mid];
+    node->left = link_balanced(nodes, lo, mid);
+    node->right = link_balanced(nodes, mid + 1, hi);
+    node->height = 1 + MAX(height(node->left), height(node->right));
+    node->size = 1 + size(node->left) + size(node->right);
+    return node;
+}
+
+/** Documented in avl.h */
+void *delete_avl(int key, AVLTree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    writeLock(tree);
+    void *value = delete_node(tree, key);
+    avl_unlock(tree);
+    return value;
+}
+
+/**
+ * Internal function for node deletion. A node with two children is
+ * replaced by its in-order successor, which is relinked in its place so
+ * that no keys or values have to be copied between nodes. Like
+ * insert_node, the path from the root is recorded on the way down and
+ * rebalanced on the way back up.
+ *
+ * @param *tree the tree being deleted from
+ * @param key key to delete
+ *
+ * @return pointer to the value of the deleted node, or NULL if the key
+ * was not found
+ */
+static void *delete_node(AVLTree *tree, int key) {
+    BSTNode **path[AVL_MAX_HEIGHT];
+    int depth = 0;
+    BSTNode **link = &tree->root;
+
+    while (*link && (*link)->key != key) {
+        path[depth++] = link;
+        link = key < (*link)->key ? &(*link)->left : &(*link)->right;
+    }
+
+    BSTNode *node = *link;
+    STAT_ADD(tree, comparisons, depth + (node != NULL));
+    if (node == NULL) {
+        return NULL;
+    }
+    void *value = node->value;
+    cache_forget(tree, key);
+
+    if (node->left == NULL || node->right == NULL) {
+        // The remaining child (if any) is already a balanced subtree
+        *link = node->left ? node->left : node->right;
+    } else {
+        // The successor takes over this position in the path
+        int top = depth;
+        path[depth++] = link;
+
+        BSTNode **min = &node->right;
+        while ((*min)->left) {
+            path[depth++] = min;
+            min = &(*min)->left;
+        }
+        BSTNode *successor = *min;
+        *min = successor->right;
+        successor->left = node->left;
+        successor->right = node->right;
+        // retrace compares against the height the position had before
+        successor->height = node->height;
+        successor->size = node->size;
+        *link = successor;
+
+        // The first link below the successor lived in the removed node
+        if (depth > top + 1) {
+            path[top + 1] = &successor->right;
+        }
+    }
+    releaseNode(tree, node);
+    tree->count--;
+
+    retrace(tree, path, depth, false);
+    return value;
+}
+
+/**
+ * Updates the height and size of a node whose subtrees are balanced, then
+ * rotates the node if its own subtrees differ in height by more than the
+ * tree allows. The rotation is chosen from the balance of the higher
+ * child, so this works after both insertions and deletions, and one
+ * rotation restores the bound for any allowed imbalance.
+ *
+ * @param *tree the tree the node belongs to
+ * @param *root the node to rebalance
+ *
+ * @return the new root of the subtree
+ */
+static BSTNode *rebalance(AVLTree *tree, BSTNode *root) {
+    root->height = 1 + MAX(height(root->left), height(root->right));
+    root->size = 1 + size(root->left) + size(root->right);
+    int balance = height(root->right) - height(root->left);
+
+    if (balance < -tree->maxImbalance) {
+        // Left-right: straighten the left subtree first
+        if (height(root->left->right) > height(root->left->left)) {
+            root->left = rotateLeft(root->left);
+            STAT_ADD(tree, doubleRotations, 1);
+        } else {
+            STAT_ADD(tree, singleRotations, 1);
+        }
+        return rotateRight(root);
+    }
+
+    if (balance > tree->maxImbalance) {
+        // Right-left: straighten the right subtree first
+        if (height(root->right->left) > height(root->right->right)) {
+            root->right = rotateRight(root->right);
+            STAT_ADD(tree, doubleRotations, 1);
+        } else {
+            STAT_ADD(tree, singleRotations, 1);
+        }
+        return rotateLeft(root);
+    }
+
+    return root;
+}
+
+/**
+ * Walks back up the path after one node was added or removed below it,
+ * rebalancing each node. Once a subtree comes out with the height it had
+ * before, nothing above it can change height or balance, so the rest of
+ * the path only has its sizes adjusted.
+ *
+ * @param *tree the tree that was changed
+ * @param *path links to the nodes above the change, from the root down
+ * @param depth number of links in the path
+ * @param grew true if a node was added, false if one was removed
+ */
+static void retrace(AVLTree *tree, BSTNode **path[], int depth, bool grew) {
+    while (depth > 0) {
+        BSTNode **link = path[--depth];
+        int before = (*link)->height;
+        *link = rebalance(tree, *link);
+        if ((*link)->height == before) {
+            break;
+        }
+    }
+    while (depth > 0) {
+        BSTNode *node = *path[--depth];
+        if (grew) {
+            node->size++;
+        } else {
+            node->size--;
+        }
+    }
+}
+
+/** Documented in avl.h */
+void *lookup_avl(int key, AVLTree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    avl_read_lock(tree);
+    BSTNode *node;
+    if (tree->cache == NULL) {
+        node = lookup(key, tree);
+    } else {
+        CacheEntry *entry = cache_slot(tree->cache, key);
+        unsigned seq = atomic_load_explicit(&entry->seq,
+                                            memory_order_acquire);
+        int cachedKey = atomic_load_explicit(&entry->key,
+                                             memory_order_relaxed);
+        node = atomic_load_explicit(&entry->node, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if ((seq & 1) || cachedKey != key || node == NULL ||
+            atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq) {
+            node = lookup(key, tree);
+            cache_fill(tree->cache, node);
+        }
+    }
+    void *value = node ? node->value : NULL;
+    avl_unlock(tree);
+    return value;
+}
+
+/**
+ * Finds the cache slot a key maps to, by Fibonacci hashing.
+ *
+ * @param *cache the cache to look in
+ * @param key the key to find a slot for
+ *
+ * @return pointer to the slot
+ */
+static CacheEntry *cache_slot(const AVLCache *cache, int key) {
+    uint32_t hash = (uint32_t) key * UINT32_C(2654435769);
+    return (CacheEntry *) &cache->entries[(hash >> cache->shift) &
+                                          cache->mask];
+}
+
+/**
+ * Remembers where a key was found. Called with only the read lock held,
+ * so another reader may be filling the same slot; in that case this one
+ * gives up rather than wait.
+ *
+ * @param *cache the cache to fill
+ * @param *node the node found, or NULL if the key is not in the tree
+ */
+static void cache_fill(AVLCache *cache, BSTNode *node) {
+    if (node == NULL) {
+        return;
+    }
+    CacheEntry *entry = cache_slot(cache, node->key);
+    unsigned seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+    if ((seq & 1) ||
+        !atomic_compare_exchange_strong_explicit(&entry->seq, &seq, seq + 1,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&entry->key, node->key, memory_order_relaxed);
+    atomic_store_explicit(&entry->node, node, memory_order_relaxed);
+    atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Empties the cache slot a key maps to, before the key's node is
+ * removed. Writers hold the tree exclusively, so no reader is using the
+ * cache at the same time.
+ *
+ * @param *tree the tree being changed
+ * @param key the key being deleted
+ */
+static void cache_forget(AVLTree *tree, int key) {
+    if (tree->cache) {
+        CacheEntry *entry = cache_slot(tree->cache, key);
+        atomic_store_explicit(&entry->node, NULL, memory_order_relaxed);
+    }
+}
+
+/**
+ * Empties every cache slot, after a change to many nodes at once.
+ *
+ * @param *tree the tree that was changed
+ */
+static void cache_clear(AVLTree *tree) {
+    if (tree->cache) {
+        for (size_t i = 0; i <= tree->cache->mask; i++) {
+            atomic_store_explicit(&tree->cache->entries[i].node, NULL,
+                                  memory_order_relaxed);
+        }
+    }
+}
+
+/** Documented in avl.h */
+size_t lookup_avl_many(AVLTree *tree, const int *keys, void **out,
+                       size_t n) {
+    if (tree == NULL) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = NULL;
+        }
+        return 0;
+    }
+
+    // Each lane follows one key; a finished lane starts on the next key
+    BSTNode *node[LOOKUP_LANES];
+    size_t index[LOOKUP_LANES];
+    size_t depth[LOOKUP_LANES];
+    size_t next = 0;
+    size_t found = 0;
+    int active = 0;
+
+    avl_read_lock(tree);
+    while (active < LOOKUP_LANES && next < n) {
+        node[active] = tree->root;
+        depth[active] = 0;
+        index[active++] = next++;
+    }
+    while (active > 0) {
+        for (int lane = 0; lane < active; lane++) {
+            BSTNode *current = node[lane];
+            int key = keys[index[lane]];
+            if (current && current->key != key) {
+                current = key < current->key ? current->left
+                                             : current->right;
+                PREFETCH(current);
+                node[lane] = current;
+                depth[lane]++;
+                continue;
+            }
+
+            if (current) {
+                out[index[lane]] = current->value;
+                found++;
+                depth[lane]++;
+            } else {
+                out[index[lane]] = NULL;
+            }
+            STAT_SEARCH(tree, depth[lane]);
+            if (next < n) {
+                node[lane] = tree->root;
+                depth[lane] = 0;
+                index[lane] = next++;
+            } else {
+                // Move the last lane here and look at it next
+                active--;
+                node[lane] = node[active];
+                depth[lane] = depth[active];
+                index[lane] = index[active];
+                lane--;
+            }
+        }
+    }
+    avl_unlock(tree);
+    return found;
+}
+
+/**
+ * Internal function for looking up a node in the tree.
+ *
+ * @param key the key to search for
+ * @param *tree the tree to search
+ *
+ * @return the node holding the given key or NULL if the key is not found
+ */
+static BSTNode *lookup(int key, AVLTree *tree) {
+    BSTNode *node = tree->root;
+    size_t depth = 0;
+    while (node) {
+        depth++;
+        if (node->key == key) {
+            break;
+        }
+        node = key < node->key ? node->left : node->right;
+    }
+    STAT_SEARCH(tree, depth);
+    return node;
+}
+
+/** Documented in avl.h */
+size_t avl_rank(AVLTree *tree, int key) {
+    if (tree == NULL) {
+        return 0;
+    }
+    avl_read_lock(tree);
+    size_t rank = count_below(key, false, tree->root);
+    avl_unlock(tree);
+    return rank;
+}
+
+/** Documented in avl.h */
+bool avl_select(AVLTree *tree, size_t k, int *key, void **value) {
+    if (tree == NULL) {
+        return false;
+    }
+    avl_read_lock(tree);
+    if (k >= tree->count) {
+        avl_unlock(tree);
+        return false;
+    }
+    BSTNode *node = tree->root;
+    while (k != size(node->left)) {
+        if (k < size(node->left)) {
+            node = node->left;
+        } else {
+            k -= size(node->left) + 1;
+            node = node->right;
+        }
+    }
+    if (key) {
+        *key = node->key;
+    }
+    if (value) {
+        *value = node->value;
+    }
+    avl_unlock(tree);
+    return true;
+}
+
+/** Documented in avl.h */
+size_t avl_count_range(AVLTree *tree, int lo, int hi) {
+    if (tree == NULL || lo > hi) {
+        return 0;
+    }
+    avl_read_lock(tree);
+    size_t count = count_below(hi, true, tree->root)
+        - count_below(lo, false, tree->root);
+    avl_unlock(tree);
+    return count;
+}
+
+/**
+ * Counts the keys in the subtree that are less than (or, if inclusive is
+ * set, less than or equal to) the given key, using the subtree sizes of
+ * the nodes passed over on a single descent.
+ *
+ * @param key the key to compare against
+ * @param inclusive whether keys equal to key are counted
+ * @param tree pointer to the root node of the subtree to search
+ *
+ * @return number of keys in the subtree below the given key
+ */
+static size_t count_below(int key, bool inclusive, BSTNode *tree) {
+    size_t count = 0;
+    while (tree) {
+        if (key > tree->key || (inclusive && key == tree->key)) {
+            count += size(tree->left) + 1;
+            tree = tree->right;
+        } else {
+            tree = tree->left;
+        }
+    }
+    return count;
+}
+
+/** Documented in avl.h */
+bool avl_iter_first(AVLIter *iter, AVLTree *tree) {
+    iter->depth = 0;
+    if (tree) {
+        descend(iter, tree->root, true);
+    }
+    return iter->depth > 0;
+}
 
-#include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
+/** Documented in avl.h */
+bool avl_iter_last(AVLIter *iter, AVLTree *tree) {
+    iter->depth = 0;
+    if (tree) {
+        descend(iter, tree->root, false);
+    }
+    return iter->depth > 0;
+}
 
-/** Evaluates to the maximum of two values */
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
+/** Documented in avl.h */
+bool avl_iter_seek(AVLIter *iter, AVLTree *tree, int key) {
+    iter->depth = 0;
+    if (tree == NULL) {
+        return false;
+    }
 
-/** Number of spaces to indent tree levels */
-#define INDENT 5
+    /* The path to the smallest key >= key is a prefix of the search path,
+        so remember how deep it was and cut the stack back to it. */
+    int found = 0;
+    BSTNode *node = tree->root;
+    while (node) {
+        iter->stack[iter->depth++] = node;
+        if (key == node->key) {
+            found = iter->depth;
+            break;
+        } else if (key < node->key) {
+            found = iter->depth;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    iter->depth = found;
+    return found > 0;
+}
 
-/* Static function prototypes */
-static int height(BSTNode *node);
-static void freeNode(BSTNode *node);
-static BSTNode *insert_node(int key, void *value, BSTNode *root);
-static void *lookup(int key, BSTNode *tree);
-static BSTNode *rotateRight(BSTNode *node);
-static BSTNode *rotateLeft(BSTNode *node);
-static void print_nodes(BSTNode *root, int indent);
+/** Documented in avl.h */
+bool avl_iter_next(AVLIter *iter) {
+    if (iter->depth == 0) {
+        return false;
+    }
+    BSTNode *node = iter->stack[iter->depth - 1];
+    if (node->right) {
+        descend(iter, node->right, true);
+        return true;
+    }
+    // Climb until we leave a left subtree; its parent is the successor
+    while (--iter->depth > 0 && iter->stack[iter->depth - 1]->right == node) {
+        node = iter->stack[iter->depth - 1];
+    }
+    return iter->depth > 0;
+}
 
 /** Documented in avl.h */
-AVLTree *createAVLTree() {
-    AVLTree *tree = malloc(sizeof(AVLTree));
-    if (tree) {
-        tree->root = NULL;
+bool avl_iter_prev(AVLIter *iter) {
+    if (iter->depth == 0) {
+        return false;
     }
-    return tree;
+    BSTNode *node = iter->stack[iter->depth - 1];
+    if (node->left) {
+        descend(iter, node->left, false);
+        return true;
+    }
+    // Climb until we leave a right subtree; its parent is the predecessor
+    while (--iter->depth > 0 && iter->stack[iter->depth - 1]->left == node) {
+        node = iter->stack[iter->depth - 1];
+    }
+    return iter->depth > 0;
 }
 
 /** Documented in avl.h */
-void freeTree(AVLTree *tree) {
+bool avl_iter_get(const AVLIter *iter, int *key, void **value) {
+    if (iter->depth == 0) {
+        return false;
+    }
+    BSTNode *node = iter->stack[iter->depth - 1];
+    if (key) {
+        *key = node->key;
+    }
+    if (value) {
+        *value = node->value;
+    }
+    return true;
+}
+
+/**
+ * Pushes the path from node down to the smallest (or largest) key in its
+ * subtree onto the iterator's stack.
+ *
+ * @param *iter the iterator to extend
+ * @param *node root of the subtree to descend, may be NULL
+ * @param leftmost true to follow left children, false to follow right
+ */
+static void descend(AVLIter *iter, BSTNode *node, bool leftmost) {
+    while (node) {
+        iter->stack[iter->depth++] = node;
+        node = leftmost ? node->left : node->right;
+    }
+}
+
+/** Documented in avl.h */
+size_t avl_range(AVLTree *tree, int lo, int hi, AVLVisitor fn, void *ctx) {
+    AVLIter iter;
+    size_t visited = 0;
+    int key;
+    void *value;
+    if (tree == NULL || lo > hi) {
+        return 0;
+    }
+    avl_read_lock(tree);
+    avl_iter_seek(&iter, tree, lo);
+    while (avl_iter_get(&iter, &key, &value) && key <= hi) {
+        visited++;
+        if (!fn(key, value, ctx)) {
+            break;
+        }
+        avl_iter_next(&iter);
+    }
+    avl_unlock(tree);
+    return visited;
+}
+
+/** Documented in avl.h */
+size_t avl_parallel_for_each(AVLTree *tree, AVLVisitor fn, void *ctx,
+                             int threads) {
     if (tree == NULL) {
-        return;
+        return 0;
     }
-    freeNode(tree->root);
-    free(tree);
+    atomic_bool stop = false;
+    atomic_size_t visited = 0;
+    avl_read_lock(tree);
+    WalkJob job = { .workers = startWorkers(threads, tree->count),
+                    .fn = fn, .ctx = ctx, .root = tree->root,
+                    .stop = &stop, .visited = &visited };
+    walk_subtree(&job);
+    freeTaskPool(job.workers);
+    avl_unlock(tree);
+    return atomic_load(&visited);
 }
 
 /**
- * Performs a postorder traversal of the tree, freeing all nodes.
+ * Walks the subtree of a WalkJob in key order. Large subtrees are split
+ * at their root, and the left side is walked on another thread.
  *
- * @param node pointer to the root node of the subtree to free
+ * @param *arg the WalkJob describing the subtree
  */
-static void freeNode(BSTNode *node) {
-    if (node == NULL) {
+static void walk_subtree(void *arg) {
+    WalkJob *job = arg;
+    BSTNode *root = job->root;
+    if (job->workers && size(root) > PARALLEL_GRAIN) {
+        WalkJob left = *job;
+        WalkJob right = *job;
+        left.root = root->left;
+        right.root = root->right;
+        Task task;
+        task_spawn(job->workers, &task, walk_subtree, &left);
+        if (!atomic_load_explicit(job->stop, memory_order_relaxed)) {
+            atomic_fetch_add_explicit(job->visited, 1, memory_order_relaxed);
+            if (!job->fn(root->key, root->value, job->ctx)) {
+                atomic_store_explicit(job->stop, true, memory_order_relaxed);
+            }
+            walk_subtree(&right);
+        }
+        task_wait(job->workers, &task);
+        return;
+    }
+
+    AVLIter iter = { .depth = 0 };
+    size_t visited = 0;
+    descend(&iter, root, true);
+    while (iter.depth > 0 &&
+           !atomic_load_explicit(job->stop, memory_order_relaxed)) {
+        BSTNode *node = iter.stack[iter.depth - 1];
+        visited++;
+        if (!job->fn(node->key, node->value, job->ctx)) {
+            atomic_store_explicit(job->stop, true, memory_order_relaxed);
+        }
+        avl_iter_next(&iter);
+    }
+    atomic_fetch_add_explicit(job->visited, visited, memory_order_relaxed);
+}
+
+/** Documented in avl.h */
+void avl_reduce(AVLTree *tree, const AVLReducer *reducer, void *result,
+                void *ctx, int threads) {
+    reducer->init(result, ctx);
+    if (tree == NULL) {
         return;
     }
-    freeNode(node->left);
-    freeNode(node->right);
-    free(node);
+    avl_read_lock(tree);
+    ReduceJob job = { .workers = startWorkers(threads, tree->count),
+                      .reducer = reducer, .ctx = ctx, .root = tree->root,
+                      .acc = result };
+    reduce_subtree(&job);
+    freeTaskPool(job.workers);
+    avl_unlock(tree);
 }
 
 /**
- * Returns the height field of the given node, or 0 if the node is NULL.
+ * Folds the subtree of a ReduceJob into its accumulator in key order.
+ * Large subtrees are split at their root: the left side is folded into
+ * the same accumulator on another thread while the right side is folded
+ * into a fresh one, which is combined in once both are done. If the
+ * fresh accumulator cannot be allocated, the subtree is folded on the
+ * calling thread instead.
  *
- * @param *node
- *      the node to find the height of
- *
- * @return the height of node n
+ * @param *arg the ReduceJob describing the subtree
  */
-static int height(BSTNode *node)
-{
-    if (node == NULL) {
-        return 0;
+static void reduce_subtree(void *arg) {
+    ReduceJob *job = arg;
+    const AVLReducer *reducer = job->reducer;
+    BSTNode *root = job->root;
+    void *acc = NULL;
+    if (job->workers && size(root) > PARALLEL_GRAIN) {
+        acc = malloc(reducer->size ? reducer->size : 1);
+    }
+    if (acc) {
+        ReduceJob left = *job;
+        ReduceJob right = *job;
+        left.root = root->left;
+        right.root = root->right;
+        right.acc = acc;
+        reducer->init(acc, job->ctx);
+        Task task;
+        task_spawn(job->workers, &task, reduce_subtree, &left);
+        reduce_subtree(&right);
+        task_wait(job->workers, &task);
+        reducer->accumulate(job->acc, root->key, root->value, job->ctx);
+        reducer->combine(job->acc, acc, job->ctx);
+        free(acc);
+        return;
+    }
+
+    AVLIter iter = { .depth = 0 };
+    descend(&iter, root, true);
+    while (iter.depth > 0) {
+        BSTNode *node = iter.stack[iter.depth - 1];
+        reducer->accumulate(job->acc, node->key, node->value, job->ctx);
+        avl_iter_next(&iter);
     }
-    return node->height;
 }
 
 /** Documented in avl.h */
-bool insert_avl(int key, void *value, AVLTree *tree) {
-    if (tree) {
-        tree->root = insert_node(key, value, tree->root);
-        return true;
+bool avl_join(AVLTree *a, AVLTree *b) {
+    if (!matching(a, b)) {
+        return false;
     }
-    return false;
+    lockPair(a, b);
+    bool ok = true;
+    if (a->root && b->root) {
+        BSTNode *last = a->root;
+        BSTNode *first = b->root;
+        while (last->right) {
+            last = last->right;
+        }
+        while (first->left) {
+            first = first->left;
+        }
+        ok = last->key < first->key;
+    }
+    if (ok && a->pool) {
+        ok = pool_adopt(a->pool, b->pool);
+    }
+    if (ok) {
+        a->root = join2(a->root, b->root);
+        a->count += b->count;
+        b->root = NULL;
+        b->count = 0;
+        cache_clear(b);
+    }
+    unlockPair(a, b);
+    return ok;
+}
+
+/** Documented in avl.h */
+AVLTree *avl_split(AVLTree *tree, int key) {
+    if (tree == NULL || tree->maxImbalance != 1) {
+        return NULL;
+    }
+    AVLTreeOptions options = { .arena = tree->pool != NULL,
+                               .concurrent = tree->lock != NULL,
+                               .valueSize = tree->valueSize,
+                               .cacheSlots = tree->cache ?
+                                             tree->cache->mask + 1 : 0 };
+    AVLTree *upper = createAVLTreeWithOptions(&options);
+    if (upper == NULL) {
+        return NULL;
+    }
+
+    writeLock(tree);
+    if (tree->pool && !pool_keep(upper->pool, tree->pool)) {
+        avl_unlock(tree);
+        freeTree(upper);
+        return NULL;
+    }
+    BSTNode *left, *right;
+    BSTNode *match = split(tree->root, key, &left, &right);
+    if (match) {
+        right = join(NULL, match, right);
+    }
+    tree->root = left;
+    tree->count = size(left);
+    cache_clear(tree);
+    upper->root = right;
+    upper->count = size(right);
+    avl_unlock(tree);
+    return upper;
+}
+
+/** Documented in avl.h */
+bool avl_union(AVLTree *a, AVLTree *b, int threads) {
+    return set_operation(a, b, threads, SET_UNION);
+}
+
+/** Documented in avl.h */
+bool avl_intersect(AVLTree *a, AVLTree *b, int threads) {
+    return set_operation(a, b, threads, SET_INTERSECT);
+}
+
+/** Documented in avl.h */
+bool avl_difference(AVLTree *a, AVLTree *b, int threads) {
+    return set_operation(a, b, threads, SET_DIFFERENCE);
 }
 
 /**
- * Internal function for node insertion.
+ * Checks whether nodes can be moved from one tree into another. Both
+ * must exist, be distinct, agree on whether they use an arena, lay out
+ * their nodes the same way, and keep strict balance, which the joins
+ * depend on.
  *
- * @param *root root node of the subtree
- * @param key key to insert
- * @param value value to insert
+ * @param *a the tree receiving nodes
+ * @param *b the tree giving up nodes
  *
- * @return pointer to the root node of the tree after insertion
+ * @return true if the trees can be combined
  */
-static BSTNode *insert_node(int key, void *value, BSTNode *root) {
-    if (root == NULL) {
-        BSTNode *node = malloc(sizeof(BSTNode));
-        /* A leaf node gets a height of 1 and a NULL node gets a height of 0,
-            to ensure the treee remains balanced */
-        *node = (BSTNode) { .height = 1, .key = key, .value = value,
-                            .left = NULL, .right = NULL };
-        return node;
+static bool matching(AVLTree *a, AVLTree *b) {
+    return a && b && a != b && (a->pool == NULL) == (b->pool == NULL) &&
+           a->valueSize == b->valueSize && a->maxImbalance == 1 &&
+           b->maxImbalance == 1;
+}
+
+/**
+ * Takes the write locks of two distinct trees, always in the same order
+ * so that two threads combining the same pair cannot deadlock.
+ *
+ * @param *a one tree to lock
+ * @param *b the other tree to lock
+ */
+static void lockPair(AVLTree *a, AVLTree *b) {
+    if (a < b) {
+        writeLock(a);
+        writeLock(b);
+    } else {
+        writeLock(b);
+        writeLock(a);
+    }
+}
+
+/**
+ * Releases the locks taken by lockPair.
+ *
+ * @param *a one tree to unlock
+ * @param *b the other tree to unlock
+ */
+static void unlockPair(AVLTree *a, AVLTree *b) {
+    avl_unlock(a);
+    avl_unlock(b);
+}
+
+/**
+ * Runs a set operation that combines b into a and leaves b empty.
+ *
+ * @param *a the tree that receives the result
+ * @param *b the tree whose nodes are consumed
+ * @param threads number of threads to use, counting the caller
+ * @param op the operation to perform
+ *
+ * @return true if successful, false if the trees do not match or
+ * allocation fails
+ */
+static bool set_operation(AVLTree *a, AVLTree *b, int threads, SetOp op) {
+    if (!matching(a, b)) {
+        return false;
+    }
+    lockPair(a, b);
+    if (a->pool && !pool_adopt(a->pool, b->pool)) {
+        unlockPair(a, b);
+        return false;
+    }
+
+    SetJob job = { .op = op, .workers = startWorkers(threads,
+                                                     a->count + b->count),
+                   .a = a->root, .b = b->root };
+    set_op(&job);
+    freeTaskPool(job.workers);
+    a->root = job.result;
+    a->count = size(job.result);
+    b->root = NULL;
+    b->count = 0;
+    cache_clear(a);
+    cache_clear(b);
+
+    // The dropped nodes now all belong to a, whichever tree they came from
+    BSTNode *node = job.dropped.head;
+    while (node) {
+        BSTNode *next = node->right;
+        releaseNode(a, node);
+        node = next;
+    }
+    unlockPair(a, b);
+    return true;
+}
+
+/**
+ * Combines the two subtrees of a SetJob. The root of one subtree is used
+ * as a pivot to split the other, the two halves are combined
+ * recursively, and the results are joined back together with or without
+ * the pivot. Large halves are combined on separate threads.
+ *
+ * @param *arg the SetJob describing the subtrees
+ */
+static void set_op(void *arg) {
+    SetJob *job = arg;
+    BSTNode *a = job->a;
+    BSTNode *b = job->b;
+    if (a == NULL || b == NULL) {
+        if (job->op == SET_UNION) {
+            job->result = a ? a : b;
+        } else if (job->op == SET_DIFFERENCE) {
+            job->result = a;
+            drop_tree(&job->dropped, b);
+        } else {
+            job->result = NULL;
+            drop_tree(&job->dropped, a ? a : b);
+        }
+        return;
     }
 
-    if (key > root->key) {
-        root->right = insert_node(key, value, root->right);
-    } else if (key < root->key) {
-        root->left = insert_node(key, value, root->left);
+    size_t work = size(a) + size(b);
+    SetJob lower = { .op = job->op, .workers = job->workers };
+    SetJob upper = lower;
+    BSTNode *pivot, *match;
+    if (job->op == SET_DIFFERENCE) {
+        pivot = b;
+        match = split(a, pivot->key, &lower.a, &upper.a);
+        lower.b = pivot->left;
+        upper.b = pivot->right;
     } else {
-        // update value in the existing node
-        root->value = value;
+        pivot = a;
+        match = split(b, pivot->key, &lower.b, &upper.b);
+        lower.a = pivot->left;
+        upper.a = pivot->right;
     }
 
-    // Update the height
-    root->height = 1 + MAX(height(root->left), height(root->right));
+    if (job->workers && work > PARALLEL_GRAIN) {
+        Task task;
+        task_spawn(job->workers, &task, set_op, &lower);
+        set_op(&upper);
+        task_wait(job->workers, &task);
+    } else {
+        set_op(&lower);
+        set_op(&upper);
+    }
+    append_list(&job->dropped, &lower.dropped);
+    append_list(&job->dropped, &upper.dropped);
 
-    /* Rebalance the subtree. A negative balance indicates that the left
-        subtree is higher */
-    int balance = height(root->right) - height(root->left);
+    switch (job->op) {
+    case SET_UNION:
+        if (match) {
+            drop_node(&job->dropped, match);
+        }
+        job->result = join(lower.result, pivot, upper.result);
+        break;
+    case SET_INTERSECT:
+        if (match) {
+            drop_node(&job->dropped, match);
+            job->result = join(lower.result, pivot, upper.result);
+        } else {
+            drop_node(&job->dropped, pivot);
+            job->result = join2(lower.result, upper.result);
+        }
+        break;
+    case SET_DIFFERENCE:
+        drop_node(&job->dropped, pivot);
+        if (match) {
+            drop_node(&job->dropped, match);
+        }
+        job->result = join2(lower.result, upper.result);
+        break;
+    }
+}
 
-    // Left-left
-    if (balance < -1 && key < root->left->key) {
-        return rotateRight(root);
+/**
+ * Adds a single node to the end of a list of dropped nodes.
+ *
+ * @param *list the list to add to
+ * @param *node the node to add
+ */
+static void drop_node(NodeList *list, BSTNode *node) {
+    node->right = NULL;
+    if (list->tail) {
+        list->tail->right = node;
+    } else {
+        list->head = node;
     }
+    list->tail = node;
+}
 
-    // Right-right
-    if (balance > 1 && key > root->right->key) {
-        return rotateLeft(root);
+/**
+ * Adds every node of a subtree to a list of dropped nodes, flattening it
+ * with rotations the same way freeNode does.
+ *
+ * @param *list the list to add to
+ * @param *node root of the subtree to drop
+ */
+static void drop_tree(NodeList *list, BSTNode *node) {
+    while (node) {
+        if (node->left) {
+            BSTNode *left = node->left;
+            node->left = left->right;
+            left->right = node;
+            node = left;
+        } else {
+            BSTNode *right = node->right;
+            drop_node(list, node);
+            node = right;
+        }
     }
+}
 
-    // Left-right
-    if (balance < -1 && key > root->left->key) {
-        root->left = rotateLeft(root->left);
-        return rotateRight(root);
+/**
+ * Moves every node of one list of dropped nodes to the end of another.
+ *
+ * @param *list the list to add to
+ * @param *more the list to take the nodes from
+ */
+static void append_list(NodeList *list, const NodeList *more) {
+    if (more->head == NULL) {
+        return;
+    }
+    if (list->tail) {
+        list->tail->right = more->head;
+    } else {
+        list->head = more->head;
     }
+    list->tail = more->tail;
+}
 
-    // Right-left
-    if (balance > 1 && key < root->right->key) {
-        root->right = rotateRight(root->right);
-        return rotateLeft(root);
+/**
+ * Recomputes the height and size fields of a node from its children.
+ *
+ * @param *node the node to update
+ */
+static void update(BSTNode *node) {
+    node->height = 1 + MAX(height(node->left), height(node->right));
+    node->size = 1 + size(node->left) + size(node->right);
+}
+
+/**
+ * Joins two subtrees and a node whose key lies between them into one
+ * balanced subtree, in time proportional to the difference in their
+ * heights.
+ *
+ * @param *left subtree of keys smaller than mid's
+ * @param *mid the node to place between the subtrees
+ * @param *right subtree of keys larger than mid's
+ *
+ * @return pointer to the root of the joined subtree
+ */
+static BSTNode *join(BSTNode *left, BSTNode *mid, BSTNode *right) {
+    if (height(left) > height(right) + 1) {
+        return join_right(left, mid, right);
+    }
+    if (height(right) > height(left) + 1) {
+        return join_left(left, mid, right);
     }
+    mid->left = left;
+    mid->right = right;
+    update(mid);
+    return mid;
+}
 
-    return root;
+/**
+ * Joins when the left subtree is the taller one, by walking down its
+ * right spine to a subtree about as tall as the right one and hanging
+ * mid there. The rotations on the way back up are those of an insertion.
+ *
+ * @param *left the taller subtree
+ * @param *mid the node to place between the subtrees
+ * @param *right the shorter subtree
+ *
+ * @return pointer to the root of the joined subtree
+ */
+static BSTNode *join_right(BSTNode *left, BSTNode *mid, BSTNode *right) {
+    BSTNode *spine = left->right;
+    if (height(spine) <= height(right) + 1) {
+        mid->left = spine;
+        mid->right = right;
+        update(mid);
+        if (height(mid) <= height(left->left) + 1) {
+            left->right = mid;
+            update(left);
+            return left;
+        }
+        left->right = rotateRight(mid);
+        update(left);
+        return rotateLeft(left);
+    }
+    left->right = join_right(spine, mid, right);
+    update(left);
+    if (height(left->right) <= height(left->left) + 1) {
+        return left;
+    }
+    return rotateLeft(left);
 }
 
-/** Documented in avl.h */
-void *delete_avl(int key, AVLTree *tree) {
-    return NULL; //TODO
+/**
+ * Mirror image of join_right, for when the right subtree is taller.
+ *
+ * @param *left the shorter subtree
+ * @param *mid the node to place between the subtrees
+ * @param *right the taller subtree
+ *
+ * @return pointer to the root of the joined subtree
+ */
+static BSTNode *join_left(BSTNode *left, BSTNode *mid, BSTNode *right) {
+    BSTNode *spine = right->left;
+    if (height(spine) <= height(left) + 1) {
+        mid->left = left;
+        mid->right = spine;
+        update(mid);
+        if (height(mid) <= height(right->right) + 1) {
+            right->left = mid;
+            update(right);
+            return right;
+        }
+        right->left = rotateLeft(mid);
+        update(right);
+        return rotateRight(right);
+    }
+    right->left = join_left(left, mid, spine);
+    update(right);
+    if (height(right->left) <= height(right->right) + 1) {
+        return right;
+    }
+    return rotateRight(right);
 }
 
-/** Documented in avl.h */
-void *lookup_avl(int key, AVLTree *tree) {
-    if (tree == NULL) {
-        return NULL;
+/**
+ * Joins two subtrees without a node between them, by taking the largest
+ * node of the left subtree to use as the middle.
+ *
+ * @param *left subtree of smaller keys
+ * @param *right subtree of larger keys
+ *
+ * @return pointer to the root of the joined subtree
+ */
+static BSTNode *join2(BSTNode *left, BSTNode *right) {
+    if (left == NULL) {
+        return right;
     }
-    return lookup(key, tree->root);
+    BSTNode *last;
+    BSTNode *rest = split_last(left, &last);
+    return join(rest, last, right);
 }
 
 /**
- * Internal function for looking up a value in the tree.
+ * Splits a subtree into the keys smaller and larger than key, in
+ * O(log n) time. A node holding key itself is detached from both.
  *
- * @param key the key to search for
- * @param tree pointer to the root node of the subtree to search
+ * @param *root root of the subtree to split
+ * @param key the key to split around
+ * @param **left set to the subtree of smaller keys
+ * @param **right set to the subtree of larger keys
  *
- * @return the value located at the given key or NULL if the key is not
- * found
+ * @return the node holding key, with stale child pointers, or NULL if
+ * the key was not found
  */
-static void *lookup(int key, BSTNode *tree) {
-    if (tree == NULL) {
+static BSTNode *split(BSTNode *root, int key, BSTNode **left,
+                      BSTNode **right) {
+    if (root == NULL) {
+        *left = NULL;
+        *right = NULL;
         return NULL;
     }
-
-    if (tree->key == key) {
-        return tree->value;
-    } else if (key < tree->key) {
-        return lookup(key, tree->left);
+    BSTNode *match, *rest;
+    if (key < root->key) {
+        match = split(root->left, key, left, &rest);
+        *right = join(rest, root, root->right);
+    } else if (key > root->key) {
+        match = split(root->right, key, &rest, right);
+        *left = join(root->left, root, rest);
     } else {
-        return lookup(key, tree->right);
+        *left = root->left;
+        *right = root->right;
+        match = root;
+    }
+    return match;
+}
+
+/**
+ * Detaches the largest node of a subtree.
+ *
+ * @param *root root of a non-empty subtree
+ * @param **last set to the detached node
+ *
+ * @return pointer to the root of the remaining subtree
+ */
+static BSTNode *split_last(BSTNode *root, BSTNode **last) {
+    if (root->right == NULL) {
+        *last = root;
+        return root->left;
     }
+    BSTNode *rest = split_last(root->right, last);
+    return join(root->left, root, rest);
 }
 
 /**
@@ -211,9 +2261,11 @@ static BSTNode *rotateRight(BSTNode *node) {
     node->left = root->right;
     root->right = node;
 
-    //update height fields
+    //update height and size fields
     node->height = 1 + MAX(height(node->left), height(node->right));
     root->height = 1 + MAX(height(root->left), height(root->right));
+    node->size = 1 + size(node->left) + size(node->right);
+    root->size = 1 + size(root->left) + size(root->right);
 
     return root;
 }
@@ -246,16 +2298,178 @@ static BSTNode *rotateLeft(BSTNode *node) {
     node->right = root->left;
     root->left = node;
 
-    //update height fields
+    //update height and size fields
     node->height = 1 + MAX(height(node->left), height(node->right));
     root->height = 1 + MAX(height(root->left), height(root->right));
+    node->size = 1 + size(node->left) + size(node->right);
+    root->size = 1 + size(root->left) + size(root->right);
 
     return root;
 }
 
+/** Documented in avl.h */
+bool avl_stats(AVLTree *tree, struct avl_stats *stats) {
+    if (tree == NULL || stats == NULL) {
+        return false;
+    }
+    *stats = (struct avl_stats) { .nodes = 0 };
+    avl_read_lock(tree);
+    stats->nodes = tree->count;
+    avl_unlock(tree);
+#ifdef AVL_STATS
+    const AVLCounters *c = &tree->counters;
+    stats->comparisons = atomic_load_explicit(&c->comparisons,
+                                              memory_order_relaxed);
+    stats->singleRotations = atomic_load_explicit(&c->singleRotations,
+                                                  memory_order_relaxed);
+    stats->doubleRotations = atomic_load_explicit(&c->doubleRotations,
+                                                  memory_order_relaxed);
+    stats->searches = atomic_load_explicit(&c->searches,
+                                           memory_order_relaxed);
+    stats->maxDepth = atomic_load_explicit(&c->maxDepth,
+                                           memory_order_relaxed);
+    size_t total = atomic_load_explicit(&c->depthTotal,
+                                        memory_order_relaxed);
+    if (stats->searches > 0) {
+        stats->averageDepth = (double) total / stats->searches;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+/** Documented in avl.h */
+bool avl_memory_usage(AVLTree *tree, struct avl_memory *usage) {
+    if (tree == NULL || usage == NULL) {
+        return false;
+    }
+    avl_read_lock(tree);
+    *usage = (struct avl_memory) {
+        .nodeBytes = tree->count * sizeof(BSTNode),
+        .valueBytes = tree->count * tree->valueSize,
+        .overheadBytes = sizeof(AVLTree) };
+    if (tree->pool) {
+        size_t held = pool_footprint(tree->pool);
+        size_t live = usage->nodeBytes + usage->valueBytes;
+        usage->arenaSlack = held > live ? held - live : 0;
+    }
+    if (tree->lock) {
+        usage->overheadBytes += sizeof(AVLLock);
+    }
+    if (tree->cache) {
+        usage->overheadBytes += sizeof(AVLCache) +
+                                (tree->cache->mask + 1) * sizeof(CacheEntry);
+    }
+    avl_unlock(tree);
+    return true;
+}
+
+/** Documented in avl.h */
+bool avl_compact(AVLTree *tree) {
+    if (tree == NULL) {
+        return false;
+    }
+    writeLock(tree);
+    NodePool *fresh;
+    if (tree->pool) {
+        fresh = createNodePoolLike(tree->pool);
+    } else {
+        fresh = createNodePool(sizeof(BSTNode) + tree->valueSize,
+                               DEFAULT_SLAB_NODES);
+    }
+    char *slots = NULL;
+    if (fresh && tree->count > 0) {
+        slots = pool_alloc_array(fresh, tree->count);
+    }
+    if (fresh == NULL || (tree->count > 0 && slots == NULL)) {
+        freeNodePool(fresh);
+        avl_unlock(tree);
+        return false;
+    }
+
+    // pool_alloc_array spaces elements by their size rounded up this way
+    size_t align = sizeof(void *);
+    size_t stride = (sizeof(BSTNode) + tree->valueSize + align - 1) /
+                    align * align;
+    BSTNode *root = tree->root ? relocate_nodes(tree, slots, stride) : NULL;
+    cache_clear(tree);
+    if (tree->pool) {
+        freeNodePool(tree->pool);
+    } else {
+        freeNode(tree->root);
+    }
+    tree->root = root;
+    tree->pool = fresh;
+    avl_unlock(tree);
+    return true;
+}
+
+/**
+ * Copies every node of a non-empty tree into an array of slots, in key
+ * order. The node with in-order index i goes in slot i, so the slots of
+ * its children follow from the sizes of their subtrees without any
+ * lookup table. The old nodes are left as they were.
+ *
+ * @param *tree the tree to copy
+ * @param *slots storage for tree->count nodes
+ * @param stride bytes from the start of one slot to the next
+ *
+ * @return the copy of the root
+ */
+static BSTNode *relocate_nodes(AVLTree *tree, char *slots, size_t stride) {
+    AVLIter iter = { .depth = 0 };
+    descend(&iter, tree->root, true);
+    for (size_t i = 0; iter.depth > 0; i++) {
+        BSTNode *node = iter.stack[iter.depth - 1];
+        BSTNode *copy = (BSTNode *) (slots + i * stride);
+        *copy = *node;
+        if (node->left) {
+            size_t at = i - 1 - size(node->left->right);
+            copy->left = (BSTNode *) (slots + at * stride);
+        }
+        if (node->right) {
+            size_t at = i + 1 + size(node->right->left);
+            copy->right = (BSTNode *) (slots + at * stride);
+        }
+        if (tree->valueSize > 0) {
+            copy->value = copy + 1;
+            memcpy(copy->value, node->value, tree->valueSize);
+        }
+        avl_iter_next(&iter);
+    }
+    return (BSTNode *) (slots + size(tree->root->left) * stride);
+}
+
+#ifdef AVL_STATS
+/**
+ * Adds a search to the tree's counters. Readers of a concurrent tree
+ * call this at the same time, so every update is atomic.
+ *
+ * @param *tree the tree that was searched
+ * @param depth number of nodes the search passed through
+ * @param compared number of those nodes the key was compared against
+ */
+static void record_search(AVLTree *tree, size_t depth, size_t compared) {
+    AVLCounters *c = &tree->counters;
+    atomic_fetch_add_explicit(&c->comparisons, compared,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->searches, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->depthTotal, depth, memory_order_relaxed);
+    size_t max = atomic_load_explicit(&c->maxDepth, memory_order_relaxed);
+    while (depth > max &&
+           !atomic_compare_exchange_weak_explicit(&c->maxDepth, &max, depth,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+#endif
+
 /** Documented in avl.h */
 void print_tree(AVLTree *tree) {
+    avl_read_lock(tree);
     print_nodes(tree->root, 0);
+    avl_unlock(tree);
 }
 
 /**
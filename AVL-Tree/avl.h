@@ -13,7 +13,101 @@
 #define AVL_H
 
 #include "bstnode.h"
+#include "nodepool.h"
 #include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Largest height difference a tree can be created to allow between the
+ * subtrees of a node. See AVLTreeOptions.maxImbalance.
+ */
+#define AVL_MAX_IMBALANCE 4
+
+/**
+ * Upper bound on the height of a tree. An AVL tree of n nodes is at most
+ * about 1.44 * log2(n) high, and one allowing a height difference of
+ * AVL_MAX_IMBALANCE at most about 2.46 * log2(n), so this covers any tree
+ * that fits in memory. It sizes the path stacks used by updates and by
+ * iterators.
+ */
+#define AVL_MAX_HEIGHT 112
+
+/**
+ * Opaque lock used by concurrent trees.
+ */
+typedef struct AVLLock AVLLock;
+
+/**
+ * Opaque cache of recently found keys.
+ */
+typedef struct AVLCache AVLCache;
+
+#ifdef AVL_STATS
+#include <stdatomic.h>
+
+/**
+ * Instrumentation counters kept by every tree when the library is built
+ * with AVL_STATS defined. Defining AVL_STATS changes the layout of
+ * AVLTree, so it must be defined the same way for every file that
+ * includes this header.
+ */
+typedef struct AVLCounters {
+    /** Nodes a key was compared against, over all searches */
+    atomic_size_t comparisons;
+    /** Single rotations made while rebalancing */
+    atomic_size_t singleRotations;
+    /** Double rotations made while rebalancing */
+    atomic_size_t doubleRotations;
+    /** Lookups and insertions */
+    atomic_size_t searches;
+    /** Sum of the depths reached by every search */
+    atomic_size_t depthTotal;
+    /** Deepest level any search reached */
+    atomic_size_t maxDepth;
+} AVLCounters;
+#endif
+
+/**
+ * Snapshot of a tree's instrumentation counters, filled in by avl_stats.
+ * Searches are counted by lookups and insertions, and comparisons by
+ * deletions too. Depth counts the root as 1.
+ */
+struct avl_stats {
+    /** Number of nodes in the tree */
+    size_t nodes;
+    /** Nodes a key was compared against */
+    size_t comparisons;
+    /** Single rotations made while rebalancing */
+    size_t singleRotations;
+    /** Double rotations made while rebalancing */
+    size_t doubleRotations;
+    /** Number of searches counted */
+    size_t searches;
+    /** Deepest level any search reached */
+    size_t maxDepth;
+    /** Mean depth reached by a search */
+    double averageDepth;
+};
+
+/**
+ * Memory held by a tree, filled in by avl_memory_usage.
+ */
+struct avl_memory {
+    /** Bytes of the nodes themselves, not counting inline values */
+    size_t nodeBytes;
+    /**
+     * Bytes of values stored inline in the nodes. Values stored by
+     * pointer belong to the caller and are not counted
+     */
+    size_t valueBytes;
+    /**
+     * Bytes the arena holds beyond the live nodes: released nodes, slab
+     * space not handed out yet and padding. Zero without an arena
+     */
+    size_t arenaSlack;
+    /** Bytes of the tree struct, its lock and its lookup cache */
+    size_t overheadBytes;
+};
 
 /**
  * Struct to hold an AVL tree. Because the root could change when
@@ -24,8 +118,99 @@
 typedef struct AVLTree {
     /** Root note of the tree */
     BSTNode *root;
+    /** Slab allocator for the nodes, or NULL to malloc each node */
+    NodePool *pool;
+    /** Number of nodes in the tree */
+    size_t count;
+    /** Reader-writer lock for a concurrent tree, or NULL */
+    AVLLock *lock;
+    /** Bytes of value stored inline after each node, or 0 */
+    size_t valueSize;
+    /** Cache checked by lookup_avl before searching, or NULL */
+    AVLCache *cache;
+    /** Largest height difference allowed between sibling subtrees */
+    int maxImbalance;
+#ifdef AVL_STATS
+    /** Instrumentation counters, read with avl_stats */
+    AVLCounters counters;
+#endif
 } AVLTree;
 
+/**
+ * Settings for createAVLTreeWithOptions. A zero-initialized struct
+ * describes the same tree as createAVLTree.
+ */
+typedef struct AVLTreeOptions {
+    /** Whether to carve nodes out of slabs, as createAVLTreeWithArena */
+    bool arena;
+    /** Number of nodes per slab, or 0 for a default size */
+    size_t slabNodes;
+    /** Whether the tree may be shared between threads, as
+        createConcurrentAVLTree */
+    bool concurrent;
+    /** If not 0, each node holds a copy of a value of this many bytes
+        instead of a pointer to the caller's value. Insertions copy from
+        the given pointer, and lookups return a pointer into the node, so
+        a hit touches no memory outside the node */
+    size_t valueSize;
+    /** If not 0, lookup_avl first checks a direct-mapped cache of about
+        this many recently found keys, rounded up to a power of two, so
+        that lookups of hot keys skip the search. Costs 16 bytes per
+        slot */
+    size_t cacheSlots;
+    /** Largest height difference allowed between the subtrees of any
+        node. 0 or 1 keeps strict AVL balance. Larger values, up to
+        AVL_MAX_IMBALANCE, let the tree grow deeper in exchange for far
+        fewer rotations on insert and delete; larger ones are reduced to
+        AVL_MAX_IMBALANCE. A relaxed tree cannot be used with avl_join,
+        avl_split or the set operations, which rely on strict balance */
+    int maxImbalance;
+} AVLTreeOptions;
+
+/**
+ * Cursor for walking a tree in key order. Holds the path from the root to
+ * the current node, so it needs no allocation and can move in either
+ * direction. An iterator is invalidated by any change to its tree.
+ */
+typedef struct AVLIter {
+    /** Nodes from the root down to the current node */
+    BSTNode *stack[AVL_MAX_HEIGHT];
+    /** Number of nodes on the stack, or 0 if past either end */
+    int depth;
+} AVLIter;
+
+/**
+ * Callback for visiting the nodes of a tree.
+ *
+ * @param key the key of the node being visited
+ * @param *value the value of the node being visited
+ * @param *ctx the context pointer given by the caller
+ *
+ * @return true to continue visiting, false to stop
+ */
+typedef bool (*AVLVisitor)(int key, void *value, void *ctx);
+
+/**
+ * Folds the nodes of a tree into a result for avl_reduce. Parts of the
+ * tree are folded into separate accumulators on different threads, and
+ * the accumulators are then combined in key order.
+ */
+typedef struct AVLReducer {
+    /** Size in bytes of an accumulator */
+    size_t size;
+    /** Sets up an empty accumulator */
+    void (*init)(void *acc, void *ctx);
+    /** Folds one node into an accumulator */
+    void (*accumulate)(void *acc, int key, void *value, void *ctx);
+    /**
+     * Folds right into acc, where every key folded into right is greater
+     * than every key folded into acc. Must be associative, but need not
+     * be commutative. right is not used again, so it may hand over what
+     * it owns
+     */
+    void (*combine)(void *acc, void *right, void *ctx);
+} AVLReducer;
+
 /**
  * Creates a new, empty tree
  *
@@ -33,6 +218,69 @@ typedef struct AVLTree {
  */
 AVLTree *createAVLTree();
 
+/**
+ * Creates a new, empty tree whose nodes are carved out of slabs instead
+ * of being allocated one at a time. Nodes removed from the tree are
+ * recycled for later insertions, and freeing the tree releases the
+ * slabs in bulk.
+ *
+ * @param slabNodes number of nodes per slab, or 0 for a default size
+ *
+ * @return pointer to a new tree, or NULL if allocation fails
+ */
+AVLTree *createAVLTreeWithArena(size_t slabNodes);
+
+/**
+ * Creates a new, empty tree that can be shared between threads. Lookups
+ * and other queries take a shared read lock, so any number of them run
+ * in parallel, while insertions and deletions take the lock exclusively.
+ * Iterators are not locked automatically; hold avl_read_lock around a
+ * walk that may run alongside writers.
+ *
+ * @return pointer to a new tree, or NULL if allocation fails
+ */
+AVLTree *createConcurrentAVLTree();
+
+/**
+ * Creates a new, empty tree with the given settings.
+ *
+ * @param *options the settings to use, or NULL for the defaults
+ *
+ * @return pointer to a new tree, or NULL if allocation fails
+ */
+AVLTree *createAVLTreeWithOptions(const AVLTreeOptions *options);
+
+/**
+ * Builds a perfectly balanced tree from keys that are already in
+ * ascending order, in linear time. The nodes are placed in key order in a
+ * single contiguous slab of the new tree's arena.
+ *
+ * @param *keys array of n keys in strictly ascending order
+ * @param **values array of n values matching the keys, or NULL to store
+ *      NULL for every key
+ * @param n number of keys
+ *
+ * @return pointer to the new tree, or NULL if the keys are not strictly
+ * ascending or allocation fails
+ */
+AVLTree *avl_build_from_sorted(const int *keys, void **values, size_t n);
+
+/**
+ * Same as avl_build_from_sorted, but fills in the subtrees on several
+ * threads at once.
+ *
+ * @param *keys array of n keys in strictly ascending order
+ * @param **values array of n values matching the keys, or NULL to store
+ *      NULL for every key
+ * @param n number of keys
+ * @param threads number of threads to use, counting the caller
+ *
+ * @return pointer to the new tree, or NULL if the keys are not strictly
+ * ascending or allocation fails
+ */
+AVLTree *avl_build_from_sorted_parallel(const int *keys, void **values,
+                                        size_t n, int threads);
+
 /**
  * Frees all memory associated with the given tree
  *
@@ -40,19 +288,149 @@ AVLTree *createAVLTree();
  */
 void freeTree(AVLTree *tree);
 
+/**
+ * Frees the given tree without waiting for its nodes to be freed. The
+ * tree itself is gone when this returns, in O(1) time, and its nodes are
+ * queued to be freed by avl_reclaim_step or the background reclaimer.
+ * Trees with an arena are reclaimed a whole slab at a time. Values are
+ * not freed, so they must not depend on reclaiming to be released. If the
+ * queue entry cannot be allocated, the tree is freed immediately instead.
+ *
+ * @param *tree the tree to free
+ */
+void avl_free_async(AVLTree *tree);
+
+/**
+ * Frees some of the nodes of trees passed to avl_free_async, so that a
+ * program can spread the cost of teardown over its own idle moments. Can
+ * be called from any thread.
+ *
+ * @param budget most nodes to free. For trees with an arena, each slab
+ *      freed counts as its number of nodes
+ *
+ * @return true if queued work remains
+ */
+bool avl_reclaim_step(size_t budget);
+
+/**
+ * Starts a background thread that frees trees as soon as they are passed
+ * to avl_free_async, so no caller needs to call avl_reclaim_step. The
+ * thread runs until the program exits. Calling this again does nothing.
+ *
+ * @return true if the background thread is running
+ */
+bool avl_reclaim_start(void);
+
+/**
+ * Takes the read lock of a concurrent tree, blocking writers until
+ * avl_unlock is called. Does nothing for other trees. Use it to keep a
+ * concurrent tree stable while walking it with an iterator, and do not
+ * call other functions on the same tree while holding it.
+ *
+ * @param *tree the tree to lock
+ */
+void avl_read_lock(AVLTree *tree);
+
+/**
+ * Releases a lock taken with avl_read_lock.
+ *
+ * @param *tree the tree to unlock
+ */
+void avl_unlock(AVLTree *tree);
+
 /**
  * Inserts a new node into the tree
  *
  * @param key the key of this node
- * @param *value pointer to the value to store
+ * @param *value pointer to the value to store. A tree with inline values
+ *      copies valueSize bytes from it instead, or zeroes them if it is
+ *      NULL
  * @param *tree pointer to the tree to insert into
  *
  * @return true if the insertion is successful
  */
 bool insert_avl(int key, void *value, AVLTree *tree);
 
+/**
+ * Finds the value slot of a key, adding a node with a NULL value (or
+ * zeroed inline bytes) if the key is missing, in a single descent. Lets
+ * a caller fill in a value only when the key is new, without a
+ * lookup_avl first.
+ *
+ * The slot stays valid until the key is deleted or the tree is
+ * restructured by a batch insert, join, split or set operation. With
+ * inline values it holds a pointer to the bytes, which may be written
+ * through but must not itself be changed. The tree's lock is not held
+ * once this returns, so on a concurrent tree writing through the slot
+ * races with other threads unless the caller arranges otherwise.
+ *
+ * @param *tree pointer to the tree to search
+ * @param key the key to find or add
+ * @param ***slot set to the address of the value stored at the key
+ * @param *created set to true if the key was added, false if it was
+ *      already present, if not NULL
+ *
+ * @return true if successful, false if a new node could not be allocated
+ */
+bool avl_upsert(AVLTree *tree, int key, void ***slot, bool *created);
+
+/**
+ * Stores a value at a key like insert_avl, and hands back the value it
+ * replaced, in a single descent.
+ *
+ * @param *tree pointer to the tree to insert into
+ * @param key the key to store at
+ * @param *value the value to store, treated as by insert_avl
+ * @param **old set to the previous value, or NULL if the key was new, if
+ *      not NULL. With inline values the previous bytes are overwritten in
+ *      place, so it is always set to NULL; use avl_upsert to read them
+ *      first
+ *
+ * @return true if successful, false if a new node could not be allocated
+ */
+bool avl_replace(AVLTree *tree, int key, void *value, void **old);
+
+/**
+ * Inserts a key that is greater than every key in the tree, for keys
+ * such as timestamps or sequence numbers that only ever grow. Follows
+ * the right spine of the tree instead of comparing keys on the way down,
+ * and the spine stays in cache between appends, so a run of appends
+ * costs far less than the same run of insert_avl calls.
+ *
+ * @param *tree pointer to the tree to append to
+ * @param key the key to add. Must be greater than the largest key
+ * @param *value the value to store, treated as by insert_avl
+ *
+ * @return true if the key was added, false if it is not greater than
+ * every key in the tree or a new node could not be allocated, in which
+ * case the tree is not changed
+ */
+bool avl_append(AVLTree *tree, int key, void *value);
+
+/**
+ * Inserts a batch of keys into the tree, with the same result as calling
+ * insert_avl for each key in array order (so the last value given for a
+ * repeated key wins). The batch is sorted first. Small batches are then
+ * inserted in key order, so consecutive descents share their path; large
+ * batches relative to the tree are merged with an in-order flattening of
+ * the tree and the tree is relinked into a perfectly balanced shape.
+ *
+ * @param *tree pointer to the tree to insert into
+ * @param *keys array of n keys, in any order
+ * @param **values array of n values matching the keys, or NULL to store
+ *      NULL for every key
+ * @param n number of keys
+ *
+ * @return true if every key was inserted. If false is returned, an
+ * allocation failed and only part of the batch may have been inserted.
+ */
+bool insert_avl_batch(AVLTree *tree, const int *keys, void **values,
+                      size_t n);
+
 /**
  * Removes a node from the tree based on its key and returns its value.
+ * With inline values, the value is released along with the node, so the
+ * result only says whether the key was found and must not be read.
  *
  * @param key the key of the tree to remove
  * @param *tree the tree to delete from
@@ -74,6 +452,296 @@ void *delete_avl(int key, AVLTree *tree);
  */
 void *lookup_avl(int key, AVLTree *tree);
 
+/**
+ * Looks up a whole group of keys at once. Several descents are in
+ * flight together, each taking one step in turn and prefetching the
+ * child it moves to, so the cache misses of different keys overlap
+ * instead of being paid one after another. Worth using for more than a
+ * handful of keys on trees larger than the cache.
+ *
+ * @param *tree the tree to search
+ * @param *keys array of n keys to look up, in any order
+ * @param **out array of n slots, each set to the value stored at the
+ *      matching key, or NULL if it was not found
+ * @param n number of keys
+ *
+ * @return number of keys that were found
+ */
+size_t lookup_avl_many(AVLTree *tree, const int *keys, void **out,
+                       size_t n);
+
+/**
+ * Counts the keys in the tree that are less than the given key, in
+ * O(log n) time. The result is also the zero-based position the key has,
+ * or would have, in ascending key order.
+ *
+ * @param *tree the tree to search
+ * @param key the key to rank
+ *
+ * @return number of keys less than key
+ */
+size_t avl_rank(AVLTree *tree, int key);
+
+/**
+ * Finds the k-th smallest key in the tree, in O(log n) time.
+ *
+ * @param *tree the tree to search
+ * @param k zero-based position of the key in ascending key order
+ * @param *key set to the key found, if not NULL
+ * @param **value set to the value found, if not NULL
+ *
+ * @return true if the tree holds more than k keys, false otherwise
+ */
+bool avl_select(AVLTree *tree, size_t k, int *key, void **value);
+
+/**
+ * Counts the keys in the tree that fall in the range [lo, hi], in
+ * O(log n) time.
+ *
+ * @param *tree the tree to search
+ * @param lo smallest key in the range
+ * @param hi largest key in the range
+ *
+ * @return number of keys in the range, or 0 if lo is greater than hi
+ */
+size_t avl_count_range(AVLTree *tree, int lo, int hi);
+
+/**
+ * Positions an iterator on the smallest key in the tree.
+ *
+ * @param *iter the iterator to position
+ * @param *tree the tree to iterate over
+ *
+ * @return true if the iterator is on a node, false if the tree is empty
+ */
+bool avl_iter_first(AVLIter *iter, AVLTree *tree);
+
+/**
+ * Positions an iterator on the largest key in the tree.
+ *
+ * @param *iter the iterator to position
+ * @param *tree the tree to iterate over
+ *
+ * @return true if the iterator is on a node, false if the tree is empty
+ */
+bool avl_iter_last(AVLIter *iter, AVLTree *tree);
+
+/**
+ * Positions an iterator on the smallest key in the tree that is greater
+ * than or equal to the given key, in O(log n) time.
+ *
+ * @param *iter the iterator to position
+ * @param *tree the tree to iterate over
+ * @param key the key to seek to
+ *
+ * @return true if the iterator is on a node, false if every key in the
+ * tree is less than key
+ */
+bool avl_iter_seek(AVLIter *iter, AVLTree *tree, int key);
+
+/**
+ * Moves an iterator to the next larger key. Once an iterator moves past
+ * either end of the tree it stays there until it is positioned again.
+ *
+ * @param *iter the iterator to move
+ *
+ * @return true if the iterator is on a node, false if it moved past the
+ * largest key
+ */
+bool avl_iter_next(AVLIter *iter);
+
+/**
+ * Moves an iterator to the next smaller key.
+ *
+ * @param *iter the iterator to move
+ *
+ * @return true if the iterator is on a node, false if it moved past the
+ * smallest key
+ */
+bool avl_iter_prev(AVLIter *iter);
+
+/**
+ * Reads the key and value of the node an iterator is on.
+ *
+ * @param *iter the iterator to read
+ * @param *key set to the key of the current node, if not NULL
+ * @param **value set to the value of the current node, if not NULL
+ *
+ * @return true if the iterator is on a node, false if it is past either
+ * end
+ */
+bool avl_iter_get(const AVLIter *iter, int *key, void **value);
+
+/**
+ * Calls fn for every key in the range [lo, hi], in ascending key order,
+ * in O(log n + k) time for k keys in the range.
+ *
+ * @param *tree the tree to scan
+ * @param lo smallest key in the range
+ * @param hi largest key in the range
+ * @param fn the function to call for each node; returning false stops
+ *      the scan. It runs under the read lock of a concurrent tree, so it
+ *      must not modify the tree
+ * @param *ctx context pointer passed through to fn
+ *
+ * @return number of nodes fn was called for
+ */
+size_t avl_range(AVLTree *tree, int lo, int hi, AVLVisitor fn, void *ctx);
+
+/**
+ * Calls fn for every node of the tree, spreading the nodes over several
+ * threads. Each thread walks its own subtrees in key order, but there
+ * is no order between threads, so fn must be safe to call concurrently.
+ * Use avl_reduce when the result depends on order.
+ *
+ * @param *tree the tree to walk
+ * @param fn the function to call for each node; returning false stops
+ *      the walk, though other threads may call it for a few more nodes
+ *      first. It runs under the read lock of a concurrent tree, so it
+ *      must not modify the tree
+ * @param *ctx context pointer passed through to fn
+ * @param threads number of threads to use, counting the caller
+ *
+ * @return number of nodes fn was called for
+ */
+size_t avl_parallel_for_each(AVLTree *tree, AVLVisitor fn, void *ctx,
+                             int threads);
+
+/**
+ * Folds every node of the tree into a single result, spreading the work
+ * over several threads. The balance of the tree keeps the two subtrees
+ * of a node close in size, so splitting at nodes hands every thread a
+ * similar share. Partial results are combined in key order, so a
+ * reducer that concatenates what it sees produces a sorted export.
+ *
+ * @param *tree the tree to fold
+ * @param *reducer how to set up, fill and combine accumulators. Its
+ *      functions may run on several threads at once, and run under the
+ *      read lock of a concurrent tree, so they must not modify the tree
+ * @param *result accumulator of reducer->size bytes that receives the
+ *      result. It is set up with reducer->init first
+ * @param *ctx context pointer passed through to the reducer
+ * @param threads number of threads to use, counting the caller
+ */
+void avl_reduce(AVLTree *tree, const AVLReducer *reducer, void *result,
+                void *ctx, int threads);
+
+/**
+ * Appends every node of b to a, leaving b empty, in O(log n) time. Every
+ * key in a must be smaller than every key in b. The trees must either
+ * both have an arena or both not have one, must store the same size of
+ * inline values and must keep strict balance; b's arena is handed over
+ * to a so the moved nodes stay valid.
+ *
+ * @param *a the tree that receives the nodes
+ * @param *b the tree whose nodes are moved. It must still be freed
+ *
+ * @return true if successful, false if the keys overlap, the trees do
+ * not match or allocation fails, in which case neither tree is changed
+ */
+bool avl_join(AVLTree *a, AVLTree *b);
+
+/**
+ * Moves every key greater than or equal to key out of the tree and into
+ * a new one, in O(log n) time. The new tree has the same settings as the
+ * original and, if the original has an arena, keeps it alive for the
+ * nodes it took over.
+ *
+ * @param *tree the tree to split. Keeps the keys smaller than key
+ * @param key the smallest key to move
+ *
+ * @return pointer to a tree holding the moved keys, or NULL if the tree
+ * has relaxed balance or allocation fails, in which case the tree is not
+ * changed
+ */
+AVLTree *avl_split(AVLTree *tree, int key);
+
+/**
+ * Moves every node of b whose key is not already in a into a, leaving b
+ * empty. Keys found in both keep the value from a. Takes O(m log(n/m+1))
+ * work for trees of sizes m <= n, using join and split on whole subtrees
+ * instead of inserting keys one at a time. The rules for matching trees
+ * are those of avl_join. Nodes left out of the result are freed, but
+ * their values are not.
+ *
+ * @param *a the tree that receives the union
+ * @param *b the tree whose nodes are moved. It must still be freed
+ * @param threads number of threads to use, counting the caller
+ *
+ * @return true if successful, false if the trees do not match or
+ * allocation fails, in which case neither tree is changed
+ */
+bool avl_union(AVLTree *a, AVLTree *b, int threads);
+
+/**
+ * Removes from a every key that is not also in b, leaving b empty. Keys
+ * that remain keep their value from a. Otherwise behaves like avl_union.
+ *
+ * @param *a the tree that receives the intersection
+ * @param *b the tree to intersect with. It must still be freed
+ * @param threads number of threads to use, counting the caller
+ *
+ * @return true if successful, false if the trees do not match or
+ * allocation fails, in which case neither tree is changed
+ */
+bool avl_intersect(AVLTree *a, AVLTree *b, int threads);
+
+/**
+ * Removes from a every key that is also in b, leaving b empty. Otherwise
+ * behaves like avl_union.
+ *
+ * @param *a the tree that receives the difference
+ * @param *b the tree of keys to remove. It must still be freed
+ * @param threads number of threads to use, counting the caller
+ *
+ * @return true if successful, false if the trees do not match or
+ * allocation fails, in which case neither tree is changed
+ */
+bool avl_difference(AVLTree *a, AVLTree *b, int threads);
+
+/**
+ * Takes a snapshot of the tree's instrumentation counters. The counters
+ * are only kept when the library is built with AVL_STATS defined; without
+ * it only the node count is filled in and every counter reads zero.
+ *
+ * @param *tree the tree to read
+ * @param *stats filled in with the snapshot
+ *
+ * @return true if the counters are available, false if instrumentation
+ * is compiled out
+ */
+bool avl_stats(AVLTree *tree, struct avl_stats *stats);
+
+/**
+ * Measures the memory a tree holds. An arena shared with trees it has
+ * been split from or joined with is counted in full for each of them.
+ *
+ * @param *tree the tree to measure
+ * @param *usage filled in with the measurements
+ *
+ * @return true if successful, false if either argument is NULL
+ */
+bool avl_memory_usage(AVLTree *tree, struct avl_memory *usage);
+
+/**
+ * Moves every node into a fresh arena, laid out in key order, and frees
+ * the old nodes. After many inserts and deletes the nodes of a tree end
+ * up scattered over memory; compacting puts neighbours in the tree back
+ * next to each other and gives the released space back. A tree without
+ * an arena gets one, as avl_join and the set operations then require of
+ * the trees it is combined with. Any pointer into a node, such as to an
+ * inline value or a slot from avl_upsert, becomes invalid.
+ *
+ * Takes O(n) time and, for a concurrent tree, holds the write lock
+ * throughout, so it is best run while the tree is quiet.
+ *
+ * @param *tree the tree to compact
+ *
+ * @return true if successful, false if allocation fails, in which case
+ * the tree is not changed
+ */
+bool avl_compact(AVLTree *tree);
+
 /**
  * Prints the tree.
  *
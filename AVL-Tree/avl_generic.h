@@ -0,0 +1,245 @@
+/**
+ * @file avl_generic.h
+ * @author Brian Gillespie
+ *
+ * Macro that generates an AVL tree specialized for one key type. The
+ * comparison is expanded directly into the search loops, so a tree of
+ * 64-bit or string keys compares keys as cheaply as the int tree in
+ * avl.h, with no call through a function pointer.
+ *
+ *     AVL_DEFINE(u64, uint64_t, AVL_CMP_NUMBER)
+ *
+ * defines the types BSTNode_u64 and AVLTree_u64 along with
+ *
+ *     AVLTree_u64 *createAVLTree_u64(void);
+ *     void freeTree_u64(AVLTree_u64 *tree);
+ *     bool insert_avl_u64(uint64_t key, void *value, AVLTree_u64 *tree);
+ *     void *delete_avl_u64(uint64_t key, AVLTree_u64 *tree);
+ *     void *lookup_avl_u64(uint64_t key, const AVLTree_u64 *tree);
+ *
+ * which behave like their counterparts in avl.h. The comparison can be a
+ * function or a function-like macro taking two keys and returning a
+ * negative, zero or positive int. Keys are stored by value, so string
+ * keys must stay valid for as long as they are in the tree.
+ *
+ * Every generated function is static inline, so the macro can be used in
+ * any file that needs the tree, and unused functions cost nothing. The
+ * generated code is also valid C++; genericcheck.c is built as both to
+ * keep it that way.
+ */
+
+#ifndef AVL_GENERIC_H
+#define AVL_GENERIC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Most nodes on any path. An AVL tree of height 64 could not fit in memory */
+#define AVL_GENERIC_MAX_HEIGHT 64
+
+/** Compares two keys of any arithmetic type */
+#define AVL_CMP_NUMBER(a, b) (((a) > (b)) - ((a) < (b)))
+
+/** Compares two NUL-terminated string keys */
+#define AVL_CMP_STRING(a, b) strcmp((a), (b))
+
+/**
+ * Defines a tree type and its functions for keys of type KeyType.
+ *
+ * @param name suffix given to every generated type and function
+ * @param KeyType type of the keys
+ * @param cmp comparison applied to two keys
+ */
+#define AVL_DEFINE(name, KeyType, cmp)                                        \
+                                                                              \
+typedef struct BSTNode_##name {                                               \
+    KeyType key;                                                              \
+    void *value;                                                              \
+    int height;                                                               \
+    struct BSTNode_##name *left;                                              \
+    struct BSTNode_##name *right;                                             \
+} BSTNode_##name;                                                             \
+                                                                              \
+typedef struct AVLTree_##name {                                               \
+    BSTNode_##name *root;                                                     \
+    size_t count;                                                             \
+} AVLTree_##name;                                                             \
+                                                                              \
+static inline int avl_height_##name(const BSTNode_##name *node) {             \
+    return node ? node->height : 0;                                           \
+}                                                                             \
+                                                                              \
+static inline void avl_update_##name(BSTNode_##name *node) {                  \
+    int left = avl_height_##name(node->left);                                 \
+    int right = avl_height_##name(node->right);                               \
+    node->height = 1 + (left > right ? left : right);                         \
+}                                                                             \
+                                                                              \
+static inline BSTNode_##name *avl_rotate_right_##name(BSTNode_##name *node) { \
+    BSTNode_##name *root = node->left;                                        \
+    node->left = root->right;                                                 \
+    root->right = node;                                                       \
+    avl_update_##name(node);                                                  \
+    avl_update_##name(root);                                                  \
+    return root;                                                              \
+}                                                                             \
+                                                                              \
+static inline BSTNode_##name *avl_rotate_left_##name(BSTNode_##name *node) {  \
+    BSTNode_##name *root = node->right;                                       \
+    node->right = root->left;                                                 \
+    root->left = node;                                                        \
+    avl_update_##name(node);                                                  \
+    avl_update_##name(root);                                                  \
+    return root;                                                              \
+}                                                                             \
+                                                                              \
+static inline BSTNode_##name *avl_rebalance_##name(BSTNode_##name *root) {    \
+    avl_update_##name(root);                                                  \
+    int balance = avl_height_##name(root->right) -                            \
+                  avl_height_##name(root->left);                              \
+    if (balance < -1) {                                                       \
+        if (avl_height_##name(root->left->right) >                            \
+            avl_height_##name(root->left->left)) {                            \
+            root->left = avl_rotate_left_##name(root->left);                  \
+        }                                                                     \
+        return avl_rotate_right_##name(root);                                 \
+    }                                                                         \
+    if (balance > 1) {                                                        \
+        if (avl_height_##name(root->right->left) >                            \
+            avl_height_##name(root->right->right)) {                          \
+            root->right = avl_rotate_right_##name(root->right);               \
+        }                                                                     \
+        return avl_rotate_left_##name(root);                                  \
+    }                                                                         \
+    return root;                                                              \
+}                                                                             \
+                                                                              \
+static inline AVLTree_##name *createAVLTree_##name(void) {                    \
+    AVLTree_##name *tree = (AVLTree_##name *) malloc(sizeof(AVLTree_##name)); \
+    if (tree) {                                                               \
+        tree->root = NULL;                                                    \
+        tree->count = 0;                                                      \
+    }                                                                         \
+    return tree;                                                              \
+}                                                                             \
+                                                                              \
+static inline void freeTree_##name(AVLTree_##name *tree) {                    \
+    if (tree == NULL) {                                                       \
+        return;                                                               \
+    }                                                                         \
+    BSTNode_##name *node = tree->root;                                        \
+    while (node) {                                                            \
+        if (node->left) {                                                     \
+            BSTNode_##name *left = node->left;                                \
+            node->left = left->right;                                         \
+            left->right = node;                                               \
+            node = left;                                                      \
+        } else {                                                              \
+            BSTNode_##name *right = node->right;                              \
+            free(node);                                                       \
+            node = right;                                                     \
+        }                                                                     \
+    }                                                                         \
+    free(tree);                                                               \
+}                                                                             \
+                                                                              \
+static inline bool insert_avl_##name(KeyType key, void *value,                \
+                                     AVLTree_##name *tree) {                  \
+    if (tree == NULL) {                                                       \
+        return false;                                                         \
+    }                                                                         \
+    BSTNode_##name **path[AVL_GENERIC_MAX_HEIGHT];                            \
+    int depth = 0;                                                            \
+    BSTNode_##name **link = &tree->root;                                      \
+    while (*link) {                                                           \
+        int order = cmp(key, (*link)->key);                                   \
+        if (order == 0) {                                                     \
+            (*link)->value = value;                                           \
+            return true;                                                      \
+        }                                                                     \
+        path[depth++] = link;                                                 \
+        link = order < 0 ? &(*link)->left : &(*link)->right;                  \
+    }                                                                         \
+    BSTNode_##name *node =                                                    \
+        (BSTNode_##name *) malloc(sizeof(BSTNode_##name));                    \
+    if (node == NULL) {                                                       \
+        return false;                                                         \
+    }                                                                         \
+    node->key = key;                                                          \
+    node->value = value;                                                      \
+    node->height = 1;                                                         \
+    node->left = NULL;                                                        \
+    node->right = NULL;                                                       \
+    *link = node;                                                             \
+    tree->count++;                                                            \
+    while (depth > 0) {                                                       \
+        link = path[--depth];                                                 \
+        *link = avl_rebalance_##name(*link);                                  \
+    }                                                                         \
+    return true;                                                              \
+}                                                                             \
+                                                                              \
+static inline void *delete_avl_##name(KeyType key, AVLTree_##name *tree) {    \
+    if (tree == NULL) {                                                       \
+        return NULL;                                                          \
+    }                                                                         \
+    BSTNode_##name **path[AVL_GENERIC_MAX_HEIGHT];                            \
+    int depth = 0;                                                            \
+    BSTNode_##name **link = &tree->root;                                      \
+    int order;                                                                \
+    while (*link && (order = cmp(key, (*link)->key)) != 0) {                  \
+        path[depth++] = link;                                                 \
+        link = order < 0 ? &(*link)->left : &(*link)->right;                  \
+    }                                                                         \
+    BSTNode_##name *node = *link;                                             \
+    if (node == NULL) {                                                       \
+        return NULL;                                                          \
+    }                                                                         \
+    void *value = node->value;                                                \
+    if (node->left == NULL || node->right == NULL) {                          \
+        *link = node->left ? node->left : node->right;                        \
+    } else {                                                                  \
+        int top = depth;                                                      \
+        path[depth++] = link;                                                 \
+        BSTNode_##name **min = &node->right;                                  \
+        while ((*min)->left) {                                                \
+            path[depth++] = min;                                              \
+            min = &(*min)->left;                                              \
+        }                                                                     \
+        BSTNode_##name *successor = *min;                                     \
+        *min = successor->right;                                              \
+        successor->left = node->left;                                         \
+        successor->right = node->right;                                       \
+        *link = successor;                                                    \
+        if (depth > top + 1) {                                                \
+            path[top + 1] = &successor->right;                                \
+        }                                                                     \
+    }                                                                         \
+    free(node);                                                               \
+    tree->count--;                                                            \
+    while (depth > 0) {                                                       \
+        link = path[--depth];                                                 \
+        *link = avl_rebalance_##name(*link);                                  \
+    }                                                                         \
+    return value;                                                             \
+}                                                                             \
+                                                                              \
+static inline void *lookup_avl_##name(KeyType key,                            \
+                                      const AVLTree_##name *tree) {           \
+    if (tree == NULL) {                                                       \
+        return NULL;                                                          \
+    }                                                                         \
+    const BSTNode_##name *node = tree->root;                                  \
+    while (node) {                                                            \
+        int order = cmp(key, node->key);                                      \
+        if (order == 0) {                                                     \
+            return node->value;                                               \
+        }                                                                     \
+        node = order < 0 ? node->left : node->right;                          \
+    }                                                                         \
+    return NULL;                                                              \
+}
+
+#endif
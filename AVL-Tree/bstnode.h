@@ -18,6 +18,9 @@ typedef struct BSTNode {
     void *value;
     /** Height of this node */
     int height;
+    /** Number of nodes in the subtree rooted at this node. Fits in the
+        padding after height, so it does not grow the node */
+    unsigned int size;
     /** Pointer to the left subtree */
     struct BSTNode *left;
     /** Pointer to the right subtree */
@@ -0,0 +1,319 @@
+/**
+ * @file compact.c
+ * @author Brian Gillespie
+ *
+ * Implementation of a compact AVL tree. The balancing rules are the same
+ * as in avl.c, but nodes are addressed by their index in a single array,
+ * which is grown by doubling. Removed nodes are kept on a free list and
+ * reused before the array grows.
+ */
+
+#include "compact.h"
+#include "avl.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Evaluates to the maximum of two values */
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/** Number of slots in a new tree's arrays */
+#define INITIAL_CAPACITY 16
+
+/* Static function prototypes */
+static bool reserve(CompactAVLTree *tree);
+static uint32_t newNode(CompactAVLTree *tree);
+static void releaseNode(CompactAVLTree *tree, uint32_t node);
+static void fixHeight(CompactNode *nodes, uint32_t node);
+static uint32_t rebalance(CompactNode *nodes, uint32_t root);
+static uint32_t rotateRight(CompactNode *nodes, uint32_t node);
+static uint32_t rotateLeft(CompactNode *nodes, uint32_t node);
+
+/** Documented in compact.h */
+CompactAVLTree *createCompactAVLTree() {
+    CompactAVLTree *tree = malloc(sizeof(CompactAVLTree));
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->nodes = malloc(INITIAL_CAPACITY * sizeof(CompactNode));
+    tree->values = malloc(INITIAL_CAPACITY * sizeof(void *));
+    if (tree->nodes == NULL || tree->values == NULL) {
+        free(tree->nodes);
+        free(tree->values);
+        free(tree);
+        return NULL;
+    }
+    // Slot 0 stands in for every missing child
+    tree->nodes[COMPACT_NIL] = (CompactNode) { .height = 0 };
+    tree->values[COMPACT_NIL] = NULL;
+    tree->root = COMPACT_NIL;
+    tree->capacity = INITIAL_CAPACITY;
+    tree->used = 1;
+    tree->freeList = COMPACT_NIL;
+    tree->count = 0;
+    return tree;
+}
+
+/** Documented in compact.h */
+void freeCompactTree(CompactAVLTree *tree) {
+    if (tree == NULL) {
+        return;
+    }
+    free(tree->nodes);
+    free(tree->values);
+    free(tree);
+}
+
+/**
+ * Makes sure a new node can be handed out without moving the arrays,
+ * doubling them if they are full.
+ *
+ * @param *tree the tree to grow
+ *
+ * @return true if a slot is available, false if the arrays could not grow
+ */
+static bool reserve(CompactAVLTree *tree) {
+    if (tree->freeList != COMPACT_NIL || tree->used < tree->capacity) {
+        return true;
+    }
+    if (tree->capacity > UINT32_MAX / 2) {
+        return false;
+    }
+    uint32_t capacity = tree->capacity * 2;
+    CompactNode *nodes = realloc(tree->nodes, capacity * sizeof(CompactNode));
+    if (nodes == NULL) {
+        return false;
+    }
+    tree->nodes = nodes;
+    void **values = realloc(tree->values, capacity * sizeof(void *));
+    if (values == NULL) {
+        return false;
+    }
+    tree->values = values;
+    tree->capacity = capacity;
+    return true;
+}
+
+/**
+ * Hands out a slot for a new node. reserve must have succeeded first.
+ *
+ * @param *tree the tree the node will belong to
+ *
+ * @return index of an uninitialized node
+ */
+static uint32_t newNode(CompactAVLTree *tree) {
+    if (tree->freeList != COMPACT_NIL) {
+        uint32_t node = tree->freeList;
+        tree->freeList = tree->nodes[node].left;
+        return node;
+    }
+    return tree->used++;
+}
+
+/**
+ * Puts a node that has been unlinked from the tree on the free list.
+ *
+ * @param *tree the tree the node belonged to
+ * @param node index of the node to release
+ */
+static void releaseNode(CompactAVLTree *tree, uint32_t node) {
+    tree->nodes[node].left = tree->freeList;
+    tree->values[node] = NULL;
+    tree->freeList = node;
+}
+
+/** Documented in compact.h */
+bool insert_compact(int key, void *value, CompactAVLTree *tree) {
+    // Grow first, so the links on the path stay valid
+    if (tree == NULL || !reserve(tree)) {
+        return false;
+    }
+
+    CompactNode *nodes = tree->nodes;
+    uint32_t *path[AVL_MAX_HEIGHT];
+    int depth = 0;
+    uint32_t *link = &tree->root;
+
+    while (*link != COMPACT_NIL) {
+        CompactNode *node = &nodes[*link];
+        if (key == node->key) {
+            // update value in the existing node
+            tree->values[*link] = value;
+            return true;
+        }
+        path[depth++] = link;
+        link = key < node->key ? &node->left : &node->right;
+    }
+
+    uint32_t node = newNode(tree);
+    nodes[node] = (CompactNode) { .key = key, .height = 1,
+                                  .left = COMPACT_NIL, .right = COMPACT_NIL };
+    tree->values[node] = value;
+    *link = node;
+    tree->count++;
+
+    while (depth > 0) {
+        link = path[--depth];
+        *link = rebalance(nodes, *link);
+    }
+    return true;
+}
+
+/** Documented in compact.h */
+void *delete_compact(int key, CompactAVLTree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+
+    CompactNode *nodes = tree->nodes;
+    uint32_t *path[AVL_MAX_HEIGHT];
+    int depth = 0;
+    uint32_t *link = &tree->root;
+
+    while (*link != COMPACT_NIL && nodes[*link].key != key) {
+        path[depth++] = link;
+        link = key < nodes[*link].key ? &nodes[*link].left
+                                      : &nodes[*link].right;
+    }
+
+    uint32_t node = *link;
+    if (node == COMPACT_NIL) {
+        return NULL;
+    }
+    void *value = tree->values[node];
+
+    if (nodes[node].left == COMPACT_NIL || nodes[node].right == COMPACT_NIL) {
+        // The remaining child (if any) is already a balanced subtree
+        *link = nodes[node].left != COMPACT_NIL ? nodes[node].left
+                                                : nodes[node].right;
+    } else {
+        // The successor takes over this position in the path
+        int top = depth;
+        path[depth++] = link;
+
+        uint32_t *min = &nodes[node].right;
+        while (nodes[*min].left != COMPACT_NIL) {
+            path[depth++] = min;
+            min = &nodes[*min].left;
+        }
+        uint32_t successor = *min;
+        *min = nodes[successor].right;
+        nodes[successor].left = nodes[node].left;
+        nodes[successor].right = nodes[node].right;
+        *link = successor;
+
+        // The first link below the successor lived in the removed node
+        if (depth > top + 1) {
+            path[top + 1] = &nodes[successor].right;
+        }
+    }
+    releaseNode(tree, node);
+    tree->count--;
+
+    while (depth > 0) {
+        link = path[--depth];
+        *link = rebalance(nodes, *link);
+    }
+    return value;
+}
+
+/** Documented in compact.h */
+void *lookup_compact(int key, CompactAVLTree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    const CompactNode *nodes = tree->nodes;
+    uint32_t node = tree->root;
+    while (node != COMPACT_NIL) {
+        if (nodes[node].key == key) {
+            return tree->values[node];
+        }
+        node = key < nodes[node].key ? nodes[node].left : nodes[node].right;
+    }
+    return NULL;
+}
+
+/**
+ * Recomputes the height of a node from its children. Missing children
+ * point at slot 0, whose height is 0.
+ *
+ * @param *nodes the node array
+ * @param node index of the node to update
+ */
+static void fixHeight(CompactNode *nodes, uint32_t node) {
+    nodes[node].height = 1 + MAX(nodes[nodes[node].left].height,
+                                 nodes[nodes[node].right].height);
+}
+
+/**
+ * Updates the height of a node whose subtrees are balanced, then rotates
+ * the node if its own subtrees differ in height by more than one. Works
+ * the same way as rebalance in avl.c.
+ *
+ * @param *nodes the node array
+ * @param root index of the node to rebalance
+ *
+ * @return index of the new root of the subtree
+ */
+static uint32_t rebalance(CompactNode *nodes, uint32_t root) {
+    fixHeight(nodes, root);
+    CompactNode *node = &nodes[root];
+    int balance = nodes[node->right].height - nodes[node->left].height;
+
+    if (balance < -1) {
+        CompactNode *left = &nodes[node->left];
+        if (nodes[left->right].height > nodes[left->left].height) {
+            node->left = rotateLeft(nodes, node->left);
+        }
+        return rotateRight(nodes, root);
+    }
+
+    if (balance > 1) {
+        CompactNode *right = &nodes[node->right];
+        if (nodes[right->left].height > nodes[right->right].height) {
+            node->right = rotateRight(nodes, node->right);
+        }
+        return rotateLeft(nodes, root);
+    }
+
+    return root;
+}
+
+/**
+ * Performs a right rotation around the given node. See rotateRight in
+ * avl.c for a diagram.
+ *
+ * @param *nodes the node array
+ * @param node index of the node to rotate the tree around
+ *
+ * @return index of the new root of the subtree
+ */
+static uint32_t rotateRight(CompactNode *nodes, uint32_t node) {
+    uint32_t root = nodes[node].left;
+    nodes[node].left = nodes[root].right;
+    nodes[root].right = node;
+
+    fixHeight(nodes, node);
+    fixHeight(nodes, root);
+    return root;
+}
+
+/**
+ * Performs a left rotation around the given node. See rotateLeft in
+ * avl.c for a diagram.
+ *
+ * @param *nodes the node array
+ * @param node index of the node to rotate the tree around
+ *
+ * @return index of the new root of the subtree
+ */
+static uint32_t rotateLeft(CompactNode *nodes, uint32_t node) {
+    uint32_t root = nodes[node].right;
+    nodes[node].right = nodes[root].left;
+    nodes[root].left = node;
+
+    fixHeight(nodes, node);
+    fixHeight(nodes, root);
+    return root;
+}
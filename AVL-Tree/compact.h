@@ -0,0 +1,109 @@
+/**
+ * @file compact.h
+ * @author Brian Gillespie
+ *
+ * Prototypes and structs for a compact AVL tree. Nodes live in one
+ * contiguous array and refer to their children by 32-bit index instead of
+ * by pointer, which brings a node down to 16 bytes so that four of them
+ * share a cache line. Values are kept in a parallel array so that a
+ * search only touches them once the key is found.
+ */
+
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Index used in place of a NULL child. Slot 0 of the node array is never
+ * handed out, and has a height of 0, so it can be read like any node.
+ */
+#define COMPACT_NIL 0
+
+/**
+ * Defines a node in a compact tree.
+ */
+typedef struct CompactNode {
+    /** Key for this node */
+    int key;
+    /** Index of the left subtree */
+    uint32_t left;
+    /** Index of the right subtree */
+    uint32_t right;
+    /** Height of this node */
+    int8_t height;
+} CompactNode;
+
+/**
+ * Struct to hold a compact AVL tree.
+ */
+typedef struct CompactAVLTree {
+    /** Node storage, indexed by node number */
+    CompactNode *nodes;
+    /** Value of each node, indexed by node number */
+    void **values;
+    /** Index of the root node */
+    uint32_t root;
+    /** Number of slots allocated in the arrays */
+    uint32_t capacity;
+    /** Number of slots handed out so far, including slot 0 */
+    uint32_t used;
+    /** Released slots, chained through their left index */
+    uint32_t freeList;
+    /** Number of nodes in the tree */
+    size_t count;
+} CompactAVLTree;
+
+/**
+ * Creates a new, empty compact tree
+ *
+ * @return pointer to a new tree, or NULL if allocation fails
+ */
+CompactAVLTree *createCompactAVLTree();
+
+/**
+ * Frees all memory associated with the given tree
+ *
+ * @param *tree the tree to free
+ */
+void freeCompactTree(CompactAVLTree *tree);
+
+/**
+ * Inserts a new node into the tree, or updates the value of an existing
+ * key.
+ *
+ * @param key the key of this node
+ * @param *value pointer to the value to store
+ * @param *tree pointer to the tree to insert into
+ *
+ * @return true if the insertion is successful, false if the node array
+ * could not grow
+ */
+bool insert_compact(int key, void *value, CompactAVLTree *tree);
+
+/**
+ * Removes a node from the tree based on its key and returns its value.
+ *
+ * @param key the key of the node to remove
+ * @param *tree the tree to delete from
+ *
+ * @return pointer to the value of the deleted node, or NULL if the key
+ * was not found.
+ */
+void *delete_compact(int key, CompactAVLTree *tree);
+
+/**
+ * Locates the key in the tree and returns a pointer to the value. The
+ * node is not removed.
+ *
+ * @param key the key to search for
+ * @param *tree the tree to search
+ *
+ * @return pointer to the value stored at the key, or NULL if the key was
+ * not found.
+ */
+void *lookup_compact(int key, CompactAVLTree *tree);
+
+#endif
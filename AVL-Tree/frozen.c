@@ -0,0 +1,126 @@
+/**
+ * @file frozen.c
+ * @author Brian Gillespie
+ *
+ * Implementation of frozen trees. The search does not stop when it finds
+ * the key. Instead it always walks to the bottom of the implicit tree,
+ * choosing the child with a comparison result rather than a branch, then
+ * recovers the lower bound from the path it took. The key array starts on
+ * a cache line boundary, so the 16 descendants four levels below a node
+ * share one line and can be prefetched together.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "frozen.h"
+#include "avl.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/** Size of a cache line in bytes */
+#define CACHE_LINE 64
+
+/** Number of keys that fit in a cache line */
+#define LINE_KEYS (CACHE_LINE / sizeof(int))
+
+#ifdef __GNUC__
+/** Hints the processor to start loading the given address */
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void) 0)
+#endif
+
+/* Static function prototypes */
+static void layout(FrozenAVLTree *frozen, AVLIter *iter, size_t pos);
+
+/** Documented in frozen.h */
+FrozenAVLTree *avl_freeze(AVLTree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    FrozenAVLTree *frozen = malloc(sizeof(FrozenAVLTree));
+    if (frozen == NULL) {
+        return NULL;
+    }
+
+    // Writers must not change the size or shape until the copy is done
+    avl_read_lock(tree);
+    void *keys = NULL;
+    size_t n = tree->count;
+    if (posix_memalign(&keys, CACHE_LINE, (n + 1) * sizeof(int)) != 0) {
+        avl_unlock(tree);
+        free(frozen);
+        return NULL;
+    }
+    frozen->keys = keys;
+    frozen->values = malloc((n + 1) * sizeof(void *));
+    if (frozen->values == NULL) {
+        avl_unlock(tree);
+        free(frozen->keys);
+        free(frozen);
+        return NULL;
+    }
+    frozen->count = n;
+
+    AVLIter iter;
+    avl_iter_first(&iter, tree);
+    layout(frozen, &iter, 1);
+    avl_unlock(tree);
+    return frozen;
+}
+
+/**
+ * Fills the implicit subtree rooted at position pos. The positions are
+ * visited in order, so taking the keys from an in-order iterator places
+ * them in breadth-first order.
+ *
+ * @param *frozen the tree being filled
+ * @param *iter iterator on the next key to place
+ * @param pos position of the subtree root
+ */
+static void layout(FrozenAVLTree *frozen, AVLIter *iter, size_t pos) {
+    if (pos > frozen->count) {
+        return;
+    }
+    layout(frozen, iter, 2 * pos);
+    avl_iter_get(iter, &frozen->keys[pos], &frozen->values[pos]);
+    avl_iter_next(iter);
+    layout(frozen, iter, 2 * pos + 1);
+}
+
+/** Documented in frozen.h */
+void freeFrozenTree(FrozenAVLTree *tree) {
+    if (tree == NULL) {
+        return;
+    }
+    free(tree->keys);
+    free(tree->values);
+    free(tree);
+}
+
+/** Documented in frozen.h */
+void *lookup_frozen(int key, const FrozenAVLTree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    const int *keys = tree->keys;
+    size_t n = tree->count;
+    size_t pos = 1;
+    while (pos <= n) {
+        PREFETCH(keys + LINE_KEYS * pos);
+        pos = 2 * pos + (keys[pos] < key);
+    }
+
+    /* Every right turn appended a 1 bit to pos. Dropping the trailing right
+        turns and the last left turn leaves the lower bound of key. */
+    while (pos & 1) {
+        pos >>= 1;
+    }
+    pos >>= 1;
+
+    if (pos != 0 && keys[pos] == key) {
+        return tree->values[pos];
+    }
+    return NULL;
+}
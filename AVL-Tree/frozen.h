@@ -0,0 +1,63 @@
+/**
+ * @file frozen.h
+ * @author Brian Gillespie
+ *
+ * Prototypes and structs for frozen snapshots of an AVL tree. A frozen
+ * tree is an immutable copy of the keys and values laid out in
+ * breadth-first (Eytzinger) order in flat arrays, so a search walks down
+ * an implicit tree by index arithmetic instead of chasing pointers.
+ */
+
+#ifndef FROZEN_H
+#define FROZEN_H
+
+#include "avl.h"
+#include <stddef.h>
+
+/**
+ * Struct to hold a frozen tree. Position 1 holds the root, and the
+ * children of position k are at 2k and 2k + 1. Position 0 is unused.
+ */
+typedef struct FrozenAVLTree {
+    /** Keys in breadth-first order */
+    int *keys;
+    /** Values matching the keys */
+    void **values;
+    /** Number of keys in the tree */
+    size_t count;
+} FrozenAVLTree;
+
+/**
+ * Creates a frozen snapshot of the given tree. The snapshot does not
+ * change when the tree does, and can be shared by any number of readers.
+ * Only value pointers are copied, so a snapshot of a tree with inline
+ * values points into its nodes, and the keys it holds must not be
+ * updated or deleted while the snapshot is in use.
+ *
+ * @param *tree the tree to copy
+ *
+ * @return pointer to the frozen tree, or NULL if allocation fails
+ */
+FrozenAVLTree *avl_freeze(AVLTree *tree);
+
+/**
+ * Frees all memory associated with the given frozen tree. The values are
+ * not freed, since they belong to the caller.
+ *
+ * @param *tree the tree to free
+ */
+void freeFrozenTree(FrozenAVLTree *tree);
+
+/**
+ * Locates the key in the frozen tree and returns a pointer to the value,
+ * with the same results lookup_avl gave on the tree when it was frozen.
+ *
+ * @param key the key to search for
+ * @param *tree the tree to search
+ *
+ * @return pointer to the value stored at the key, or NULL if the key was
+ * not found.
+ */
+void *lookup_frozen(int key, const FrozenAVLTree *tree);
+
+#endif
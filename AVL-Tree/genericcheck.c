@@ -0,0 +1,138 @@
+/**
+ * @file genericcheck.c
+ * @author Brian Gillespie
+ *
+ * Check for the trees generated by avl_generic.h. Instantiates a tree of
+ * 64-bit keys and a tree of string keys, runs inserts, lookups and
+ * deletes against them and verifies the AVL balance after each phase.
+ * The Makefile builds this file as both C and C++, so the generated code
+ * is checked under both languages. Exits with a nonzero status if any
+ * check fails.
+ */
+
+#include "avl_generic.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+AVL_DEFINE(u64, uint64_t, AVL_CMP_NUMBER)
+AVL_DEFINE(str, const char *, AVL_CMP_STRING)
+
+/** Number of keys inserted into each tree */
+#define KEYS 20000
+
+/** Room for the text of one string key */
+#define KEY_LENGTH 16
+
+/**
+ * Returns the height of a subtree, or -1 if any node in it is out of
+ * balance or has a stale height.
+ */
+#define CHECK_HEIGHT(name)                                                    \
+static int check_height_##name(const BSTNode_##name *node) {                  \
+    if (node == NULL) {                                                       \
+        return 0;                                                             \
+    }                                                                         \
+    int left = check_height_##name(node->left);                               \
+    int right = check_height_##name(node->right);                             \
+    int height = 1 + (left > right ? left : right);                           \
+    if (left < 0 || right < 0 || abs(left - right) > 1 ||                     \
+        height != node->height) {                                             \
+        return -1;                                                            \
+    }                                                                         \
+    return height;                                                            \
+}
+
+CHECK_HEIGHT(u64)
+CHECK_HEIGHT(str)
+
+/* Static function prototypes */
+static bool check_u64(void);
+static bool check_str(void);
+
+/**
+ * Runs every check and reports the result.
+ */
+int main() {
+    bool ok = check_u64() && check_str();
+    printf("generic trees %s\n", ok ? "passed" : "FAILED");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Checks the tree of 64-bit keys, using keys that do not fit in an int.
+ *
+ * @return true if every check passed
+ */
+static bool check_u64(void) {
+    static int values[KEYS];
+    AVLTree_u64 *tree = createAVLTree_u64();
+    bool ok = tree != NULL;
+    // Odd multipliers visit every key once, in a scattered order
+    for (uint64_t i = 0; ok && i < KEYS; i++) {
+        uint64_t key = ((i * 7919) % KEYS) << 33;
+        ok = insert_avl_u64(key, &values[key >> 33], tree);
+    }
+    ok = ok && tree->count == KEYS && check_height_u64(tree->root) > 0;
+    for (uint64_t i = 0; ok && i < KEYS; i++) {
+        ok = lookup_avl_u64(i << 33, tree) == &values[i] &&
+             lookup_avl_u64((i << 33) + 1, tree) == NULL;
+    }
+    for (uint64_t i = 0; ok && i < KEYS; i += 2) {
+        ok = delete_avl_u64(i << 33, tree) == &values[i];
+    }
+    ok = ok && tree->count == KEYS / 2 && check_height_u64(tree->root) > 0;
+    for (uint64_t i = 0; ok && i < KEYS; i++) {
+        void *expected = i % 2 ? &values[i] : NULL;
+        ok = lookup_avl_u64(i << 33, tree) == expected;
+    }
+
+    ok = ok && !insert_avl_u64(1, NULL, NULL) &&
+         delete_avl_u64(1, NULL) == NULL && lookup_avl_u64(1, NULL) == NULL;
+    if (!ok) {
+        printf("u64 tree check failed\n");
+    }
+    freeTree_u64(tree);
+    return ok;
+}
+
+/**
+ * Checks the tree of string keys. Lookups use copies of the inserted
+ * strings, so the keys must be compared by content.
+ *
+ * @return true if every check passed
+ */
+static bool check_str(void) {
+    static char keys[KEYS][KEY_LENGTH];
+    static char probe[KEY_LENGTH];
+    AVLTree_str *tree = createAVLTree_str();
+    bool ok = tree != NULL;
+    for (int i = 0; ok && i < KEYS; i++) {
+        int index = (int) ((i * 7919L) % KEYS);
+        snprintf(keys[index], KEY_LENGTH, "key%d", index);
+        ok = insert_avl_str(keys[index], keys[index], tree);
+    }
+    ok = ok && tree->count == KEYS && check_height_str(tree->root) > 0;
+    for (int i = 0; ok && i < KEYS; i++) {
+        snprintf(probe, KEY_LENGTH, "key%d", i);
+        ok = lookup_avl_str(probe, tree) == keys[i];
+    }
+    for (int i = 0; ok && i < KEYS; i += 3) {
+        snprintf(probe, KEY_LENGTH, "key%d", i);
+        ok = delete_avl_str(probe, tree) == keys[i] &&
+             lookup_avl_str(probe, tree) == NULL;
+    }
+    ok = ok && tree->count == KEYS - (KEYS + 2) / 3 &&
+         check_height_str(tree->root) > 0 &&
+         lookup_avl_str("missing", tree) == NULL;
+
+    ok = ok && !insert_avl_str("key", NULL, NULL) &&
+         delete_avl_str("key", NULL) == NULL &&
+         lookup_avl_str("key", NULL) == NULL;
+    if (!ok) {
+        printf("string tree check failed\n");
+    }
+    freeTree_str(tree);
+    return ok;
+}
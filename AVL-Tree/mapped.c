@@ -0,0 +1,281 @@
+/**
+ * @file mapped.c
+ * @author Brian Gillespie
+ *
+ * Implementation of mapped trees. A file is a header, followed by the
+ * node array starting with the unused slot 0, followed by the value
+ * array aligned to eight bytes. Nodes are numbered in breadth-first
+ * order, so the top levels of the tree, which every lookup passes
+ * through, share the first few pages of the file.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "mapped.h"
+#include "avl.h"
+#include "compact.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Identifies a saved tree. Reads differently on the other byte order */
+#define MAPPED_MAGIC UINT64_C(0x3130504D4C5641)
+
+/** Rounds n up to a multiple of eight */
+#define ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+
+/**
+ * Layout of the start of a saved tree.
+ */
+typedef struct MappedHeader {
+    /** Always MAPPED_MAGIC */
+    uint64_t magic;
+    /** Number of nodes in the tree */
+    uint64_t count;
+    /** Bytes of value stored for each node */
+    uint64_t valueSize;
+    /** Offset of the value array from the start of the file */
+    uint64_t valuesOffset;
+} MappedHeader;
+
+/* Static function prototypes */
+static bool write_tree(AVLTree *tree, FILE *file);
+static size_t values_offset(size_t count);
+static mode_t save_mode(const char *path);
+static mode_t process_umask(void);
+
+/** Documented in mapped.h */
+bool avl_save(AVLTree *tree, const char *path) {
+    if (tree == NULL || path == NULL) {
+        return false;
+    }
+    // A unique name next to path, so concurrent saves cannot collide
+    size_t length = strlen(path);
+    char *temp = malloc(length + sizeof(".XXXXXX"));
+    if (temp == NULL) {
+        return false;
+    }
+    memcpy(temp, path, length);
+    memcpy(temp + length, ".XXXXXX", sizeof(".XXXXXX"));
+
+    bool ok = false;
+    FILE *file = NULL;
+    int fd = mkstemp(temp);
+    if (fd >= 0) {
+        // mkstemp creates the file private to the owner
+        file = fchmod(fd, save_mode(path)) == 0 ? fdopen(fd, "wb") : NULL;
+        if (file == NULL) {
+            close(fd);
+            remove(temp);
+        }
+    }
+    if (file) {
+        avl_read_lock(tree);
+        ok = write_tree(tree, file);
+        avl_unlock(tree);
+        ok = fclose(file) == 0 && ok;
+        ok = ok && rename(temp, path) == 0;
+        if (!ok) {
+            remove(temp);
+        }
+    }
+    free(temp);
+    return ok;
+}
+
+/**
+ * Picks the permissions for a saved file: those of the file being
+ * replaced, or those fopen would have given a new file.
+ *
+ * @param *path name of the file being saved
+ *
+ * @return the mode to give the temporary file
+ */
+static mode_t save_mode(const char *path) {
+    struct stat existing;
+    if (stat(path, &existing) == 0) {
+        return existing.st_mode & 07777;
+    }
+    return 0666 & ~process_umask();
+}
+
+/**
+ * Reads the process umask. Linux reports it in /proc/self/status, which
+ * leaves it untouched; elsewhere it has to be set and restored, briefly
+ * exposing files other threads create in between to the default mask.
+ *
+ * @return the file mode creation mask
+ */
+static mode_t process_umask(void) {
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status) {
+        char line[128];
+        unsigned int mask;
+        while (fgets(line, sizeof(line), status)) {
+            if (sscanf(line, "Umask: %o", &mask) == 1) {
+                fclose(status);
+                return (mode_t) mask;
+            }
+        }
+        fclose(status);
+    }
+    mode_t mask = umask(022);
+    umask(mask);
+    return mask;
+}
+
+/**
+ * Finds where the value array starts in a file of count nodes.
+ *
+ * @param count number of nodes in the tree
+ *
+ * @return offset of the value array from the start of the file
+ */
+static size_t values_offset(size_t count) {
+    return ALIGN8(sizeof(MappedHeader) + (count + 1) * sizeof(CompactNode));
+}
+
+/**
+ * Writes the header, nodes and values of a locked tree. The nodes are
+ * numbered as they come off a breadth-first queue, so each child's index
+ * is known as soon as it is queued.
+ *
+ * @param *tree the tree to write
+ * @param *file the file to write to
+ *
+ * @return true if everything was written
+ */
+static bool write_tree(AVLTree *tree, FILE *file) {
+    size_t count = tree->count;
+    if (count >= UINT32_MAX) {
+        return false;
+    }
+    BSTNode **queue = malloc((count + 1) * sizeof(BSTNode *));
+    if (queue == NULL) {
+        return false;
+    }
+
+    MappedHeader header = { .magic = MAPPED_MAGIC, .count = count,
+                            .valueSize = tree->valueSize,
+                            .valuesOffset = values_offset(count) };
+    // Nodes are zeroed first so their padding never reaches the file
+    CompactNode sentinel;
+    memset(&sentinel, 0, sizeof(sentinel));
+    sentinel.left = COMPACT_NIL;
+    sentinel.right = COMPACT_NIL;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(&sentinel, sizeof(sentinel), 1, file) == 1;
+
+    // queue[i] becomes node i + 1 in the file
+    size_t tail = 0;
+    if (tree->root) {
+        queue[tail++] = tree->root;
+    }
+    for (size_t head = 0; head < tail && ok; head++) {
+        BSTNode *node = queue[head];
+        CompactNode out;
+        memset(&out, 0, sizeof(out));
+        out.key = node->key;
+        out.left = COMPACT_NIL;
+        out.right = COMPACT_NIL;
+        out.height = node->height;
+        if (node->left) {
+            queue[tail++] = node->left;
+            out.left = tail;
+        }
+        if (node->right) {
+            queue[tail++] = node->right;
+            out.right = tail;
+        }
+        ok = fwrite(&out, sizeof(out), 1, file) == 1;
+    }
+
+    if (ok && tree->valueSize > 0) {
+        static const char padding[8];
+        size_t written = sizeof(header) + (count + 1) * sizeof(CompactNode);
+        size_t gap = header.valuesOffset - written;
+        ok = fwrite(padding, 1, gap, file) == gap;
+        for (size_t i = 0; i < tail && ok; i++) {
+            ok = fwrite(queue[i]->value, tree->valueSize, 1, file) == 1;
+        }
+    }
+    free(queue);
+    return ok;
+}
+
+/** Documented in mapped.h */
+MappedAVLTree *avl_open_mmap(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 ||
+        (size_t) info.st_size < sizeof(MappedHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t length = info.st_size;
+    void *base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Check that the arrays the header describes fit in the file
+    const MappedHeader *header = base;
+    bool valid = header->magic == MAPPED_MAGIC &&
+                 header->count < UINT32_MAX &&
+                 header->valuesOffset == values_offset(header->count) &&
+                 header->valuesOffset <= length;
+    if (valid && header->count > 0) {
+        valid = header->valueSize <= (length - header->valuesOffset) /
+                                     header->count;
+    }
+    MappedAVLTree *tree = valid ? malloc(sizeof(MappedAVLTree)) : NULL;
+    if (tree == NULL) {
+        munmap(base, length);
+        return NULL;
+    }
+    tree->base = base;
+    tree->length = length;
+    tree->nodes = (const CompactNode *) (header + 1);
+    tree->values = (const unsigned char *) base + header->valuesOffset;
+    tree->valueSize = header->valueSize;
+    tree->count = header->count;
+    return tree;
+}
+
+/** Documented in mapped.h */
+void avl_close_mmap(MappedAVLTree *tree) {
+    if (tree == NULL) {
+        return;
+    }
+    munmap(tree->base, tree->length);
+    free(tree);
+}
+
+/** Documented in mapped.h */
+const void *lookup_mapped(int key, const MappedAVLTree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    const CompactNode *nodes = tree->nodes;
+    uint32_t index = tree->count > 0 ? 1 : COMPACT_NIL;
+
+    // The bound keeps a damaged file from sending the search outside it
+    while (index != COMPACT_NIL && index <= tree->count) {
+        const CompactNode *node = &nodes[index];
+        if (key == node->key) {
+            return tree->values + (size_t) (index - 1) * tree->valueSize;
+        }
+        index = key < node->key ? node->left : node->right;
+    }
+    return NULL;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file mapped.h
+ * @author Brian Gillespie
+ *
+ * Prototypes and structs for saving an AVL tree to a file that can be
+ * searched in place after mapping it into memory. The file holds the
+ * nodes in the index-based layout of compact.h, so it contains no
+ * pointers and can be mapped at any address. Opening a file does no work
+ * proportional to its size; the operating system pages in only the
+ * nodes that lookups actually touch.
+ *
+ * Values are saved only for trees that store them inline (see
+ * AVLTreeOptions.valueSize), since value pointers mean nothing to
+ * another process. Files use the byte order of the machine that wrote
+ * them, and are rejected by machines of the other byte order.
+ */
+
+#ifndef MAPPED_H
+#define MAPPED_H
+
+#include "avl.h"
+#include "compact.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Struct to hold a mapped tree. The node and value arrays point into the
+ * mapping, which is read-only.
+ */
+typedef struct MappedAVLTree {
+    /** Start of the mapping */
+    void *base;
+    /** Length of the mapping in bytes */
+    size_t length;
+    /** Nodes in breadth-first order. Slot 0 is unused and slot 1 holds
+        the root */
+    const CompactNode *nodes;
+    /** Inline values, valueSize bytes per node in node order, starting
+        with node 1 */
+    const unsigned char *values;
+    /** Bytes of value stored for each node, or 0 */
+    size_t valueSize;
+    /** Number of nodes in the tree */
+    size_t count;
+} MappedAVLTree;
+
+/**
+ * Writes the tree to a file that avl_open_mmap can load. The file is
+ * written under a unique temporary name in the same directory and then
+ * renamed over path, so readers never see a partly written file and
+ * concurrent saves to the same path do not corrupt each other. A file
+ * that is replaced keeps its permissions, and a new file gets the ones
+ * fopen would give it. The same tree always produces the same bytes.
+ *
+ * @param *tree the tree to save
+ * @param *path name of the file to write
+ *
+ * @return true if the file was written, false if the tree has more nodes
+ * than a compact index can address or an I/O error occurred
+ */
+bool avl_save(AVLTree *tree, const char *path);
+
+/**
+ * Maps a file written by avl_save into memory, ready for lookups.
+ *
+ * @param *path name of the file to open
+ *
+ * @return pointer to the mapped tree, or NULL if the file could not be
+ * mapped or is not a tree saved on this kind of machine
+ */
+MappedAVLTree *avl_open_mmap(const char *path);
+
+/**
+ * Unmaps the file and frees the mapped tree. Any value pointers returned
+ * by lookup_mapped become invalid.
+ *
+ * @param *tree the tree to close
+ */
+void avl_close_mmap(MappedAVLTree *tree);
+
+/**
+ * Locates the key in the mapped tree and returns a pointer to its value.
+ *
+ * @param key the key to search for
+ * @param *tree the tree to search
+ *
+ * @return pointer to the valueSize bytes of the value stored at the key,
+ * or NULL if the key was not found. For a tree saved without inline
+ * values the pointer is not NULL, but there is nothing to read
+ */
+const void *lookup_mapped(int key, const MappedAVLTree *tree);
+
+#endif
@@ -0,0 +1,323 @@
+/**
+ * @file nodepool.c
+ * @author Brian Gillespie
+ *
+ * Implementation of a slab allocator for fixed-size elements. Each slab
+ * is a single allocation holding many elements. New elements are handed
+ * out by bumping a pointer through the newest slab, and released
+ * elements are threaded onto an intrusive free list through their first
+ * word.
+ *
+ * Slabs are owned by a reference-counted store rather than by the pool
+ * itself. A pool adds slabs to its own store, but can also hold
+ * references to the stores of other pools, which is how elements move
+ * between pools. Stores never reference each other, so no cycle of
+ * references can keep memory alive.
+ */
+
+#include "nodepool.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * A single chunk of element storage. The element array follows the
+ * header in the same allocation.
+ */
+typedef struct Slab {
+    /** Next (older) slab in the pool */
+    struct Slab *next;
+    /** Size of the allocation, header included */
+    size_t bytes;
+    /** Element storage. Declared as pointers to keep it aligned */
+    void *data[];
+} Slab;
+
+/**
+ * A reference-counted list of slabs. Only the pool that created a store
+ * adds slabs to it; other pools just hold a reference.
+ */
+typedef struct SlabStore {
+    /** Number of pools referencing this store */
+    atomic_size_t refs;
+    /**
+     * Slabs in this store, newest first. Atomic so that pools sharing the
+     * store can walk it while its owner adds slabs
+     */
+    _Atomic(Slab *) slabs;
+} SlabStore;
+
+/**
+ * An element on the free list. Overlays the first word of a released
+ * element.
+ */
+typedef struct FreeElem {
+    /** Next released element */
+    struct FreeElem *next;
+} FreeElem;
+
+/** Defined in nodepool.h */
+struct NodePool {
+    /** Size of each element, rounded up to keep elements aligned */
+    size_t elemSize;
+    /** Number of elements in each slab */
+    size_t perSlab;
+    /** Stores referenced by this pool. The first receives new slabs */
+    SlabStore **stores;
+    /** Number of entries in stores */
+    size_t storeCount;
+    /** Next unused byte in the newest slab */
+    char *next;
+    /** One past the last byte of the newest slab */
+    char *end;
+    /** Released elements available for reuse */
+    FreeElem *freeList;
+};
+
+/* Static function prototypes */
+static SlabStore *createStore();
+static void releaseStore(SlabStore *store);
+static bool addStores(NodePool *pool, NodePool *other);
+static bool addSlab(NodePool *pool, size_t count);
+
+/** Documented in nodepool.h */
+NodePool *createNodePool(size_t elemSize, size_t perSlab) {
+    if (elemSize == 0 || perSlab == 0) {
+        return NULL;
+    }
+    NodePool *pool = malloc(sizeof(NodePool));
+    if (pool) {
+        // Round up so every element starts on a pointer boundary
+        size_t align = sizeof(void *);
+        if (elemSize < sizeof(FreeElem)) {
+            elemSize = sizeof(FreeElem);
+        }
+        pool->elemSize = (elemSize + align - 1) / align * align;
+        pool->perSlab = perSlab;
+        pool->next = NULL;
+        pool->end = NULL;
+        pool->freeList = NULL;
+        pool->stores = malloc(sizeof(SlabStore *));
+        pool->storeCount = 1;
+        if (pool->stores == NULL ||
+            (pool->stores[0] = createStore()) == NULL) {
+            free(pool->stores);
+            free(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/** Documented in nodepool.h */
+NodePool *createNodePoolLike(const NodePool *pool) {
+    return createNodePool(pool->elemSize, pool->perSlab);
+}
+
+/**
+ * Allocates an empty store with a single reference.
+ *
+ * @return pointer to the new store, or NULL if allocation fails
+ */
+static SlabStore *createStore() {
+    SlabStore *store = malloc(sizeof(SlabStore));
+    if (store) {
+        atomic_init(&store->refs, 1);
+        atomic_init(&store->slabs, NULL);
+    }
+    return store;
+}
+
+/**
+ * Drops a reference to a store, freeing its slabs once no pool
+ * references it.
+ *
+ * @param *store the store to release
+ */
+static void releaseStore(SlabStore *store) {
+    if (atomic_fetch_sub(&store->refs, 1) != 1) {
+        return;
+    }
+    Slab *slab = store->slabs;
+    while (slab) {
+        Slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    free(store);
+}
+
+/** Documented in nodepool.h */
+void freeNodePool(NodePool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < pool->storeCount; i++) {
+        releaseStore(pool->stores[i]);
+    }
+    free(pool->stores);
+    free(pool);
+}
+
+/** Documented in nodepool.h */
+bool pool_free_step(NodePool *pool, size_t *budget) {
+    while (pool->storeCount > 0) {
+        SlabStore *store = pool->stores[pool->storeCount - 1];
+        // A store another pool still references costs only a reference
+        if (atomic_load(&store->refs) == 1) {
+            while (store->slabs && *budget > 0) {
+                Slab *slab = store->slabs;
+                store->slabs = slab->next;
+                free(slab);
+                *budget -= *budget < pool->perSlab ? *budget : pool->perSlab;
+            }
+            if (store->slabs) {
+                return false;
+            }
+        }
+        releaseStore(store);
+        pool->storeCount--;
+    }
+    free(pool->stores);
+    free(pool);
+    return true;
+}
+
+/**
+ * Makes pool reference every store that other references, skipping the
+ * ones it already holds.
+ *
+ * @param *pool the pool taking references
+ * @param *other the pool whose stores are referenced
+ *
+ * @return true if the references were taken, false if allocation fails
+ */
+static bool addStores(NodePool *pool, NodePool *other) {
+    SlabStore **stores = realloc(pool->stores,
+                                 (pool->storeCount + other->storeCount) *
+                                 sizeof(SlabStore *));
+    if (stores == NULL) {
+        return false;
+    }
+    pool->stores = stores;
+    for (size_t i = 0; i < other->storeCount; i++) {
+        SlabStore *store = other->stores[i];
+        bool held = false;
+        for (size_t j = 0; j < pool->storeCount && !held; j++) {
+            held = stores[j] == store;
+        }
+        if (!held) {
+            atomic_fetch_add(&store->refs, 1);
+            stores[pool->storeCount++] = store;
+        }
+    }
+    return true;
+}
+
+/** Documented in nodepool.h */
+bool pool_keep(NodePool *pool, NodePool *other) {
+    return pool == other || addStores(pool, other);
+}
+
+/** Documented in nodepool.h */
+bool pool_adopt(NodePool *pool, NodePool *other) {
+    if (pool == other) {
+        return true;
+    }
+    SlabStore *fresh = createStore();
+    if (fresh == NULL || !addStores(pool, other)) {
+        free(fresh);
+        return false;
+    }
+    for (size_t i = 0; i < other->storeCount; i++) {
+        releaseStore(other->stores[i]);
+    }
+    // The array always has room for at least one entry
+    other->stores[0] = fresh;
+    other->storeCount = 1;
+    other->next = NULL;
+    other->end = NULL;
+    other->freeList = NULL;
+    return true;
+}
+
+/**
+ * Allocates a new slab and makes it the one new elements are carved from.
+ * Any space left in the previous slab is abandoned.
+ *
+ * @param *pool the pool to grow
+ * @param count number of elements the slab should hold
+ *
+ * @return true if the slab was allocated
+ */
+static bool addSlab(NodePool *pool, size_t count) {
+    if (count > (SIZE_MAX - sizeof(Slab)) / pool->elemSize) {
+        return false;
+    }
+    size_t bytes = pool->elemSize * count;
+    Slab *slab = malloc(sizeof(Slab) + bytes);
+    if (slab == NULL) {
+        return false;
+    }
+    slab->bytes = sizeof(Slab) + bytes;
+    slab->next = pool->stores[0]->slabs;
+    pool->stores[0]->slabs = slab;
+    pool->next = (char *) slab->data;
+    pool->end = pool->next + bytes;
+    return true;
+}
+
+/** Documented in nodepool.h */
+void *pool_alloc(NodePool *pool) {
+    if (pool->freeList) {
+        FreeElem *elem = pool->freeList;
+        pool->freeList = elem->next;
+        return elem;
+    }
+
+    if (pool->next == pool->end && !addSlab(pool, pool->perSlab)) {
+        return NULL;
+    }
+
+    void *elem = pool->next;
+    pool->next += pool->elemSize;
+    return elem;
+}
+
+/** Documented in nodepool.h */
+bool pool_reserve(NodePool *pool, size_t count) {
+    size_t left = (size_t) (pool->end - pool->next) / pool->elemSize;
+    if (count <= left) {
+        return true;
+    }
+    return addSlab(pool, count > pool->perSlab ? count : pool->perSlab);
+}
+
+/** Documented in nodepool.h */
+void *pool_alloc_array(NodePool *pool, size_t count) {
+    if (count == 0 || !pool_reserve(pool, count)) {
+        return NULL;
+    }
+    void *first = pool->next;
+    pool->next += pool->elemSize * count;
+    return first;
+}
+
+/** Documented in nodepool.h */
+void pool_release(NodePool *pool, void *elem) {
+    FreeElem *freed = elem;
+    freed->next = pool->freeList;
+    pool->freeList = freed;
+}
+
+/** Documented in nodepool.h */
+size_t pool_footprint(const NodePool *pool) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < pool->storeCount; i++) {
+        for (Slab *slab = pool->stores[i]->slabs; slab; slab = slab->next) {
+            bytes += slab->bytes;
+        }
+    }
+    return bytes;
+}
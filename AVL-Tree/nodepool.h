@@ -0,0 +1,146 @@
+/**
+ * @file nodepool.h
+ * @author Brian Gillespie
+ *
+ * Prototypes for a slab allocator that hands out fixed-size elements.
+ * Elements are carved out of large slabs, and released elements are kept
+ * on a free list so they can be reused by later allocations. All slabs
+ * are released together when the pool is freed.
+ */
+
+#ifndef NODEPOOL_H
+#define NODEPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Opaque handle to a pool of fixed-size elements.
+ */
+typedef struct NodePool NodePool;
+
+/**
+ * Creates a new, empty pool.
+ *
+ * @param elemSize size in bytes of each element handed out by the pool
+ * @param perSlab number of elements to carve out of each slab
+ *
+ * @return pointer to a new pool, or NULL if allocation fails
+ */
+NodePool *createNodePool(size_t elemSize, size_t perSlab);
+
+/**
+ * Creates a new, empty pool that hands out elements of the same size,
+ * and carves the same number out of each slab, as another pool.
+ *
+ * @param *pool the pool to copy the settings of
+ *
+ * @return pointer to a new pool, or NULL if allocation fails
+ */
+NodePool *createNodePoolLike(const NodePool *pool);
+
+/**
+ * Releases the pool, along with every slab that no other pool is keeping
+ * alive. Any elements still in use from those slabs become invalid.
+ *
+ * @param *pool the pool to free
+ */
+void freeNodePool(NodePool *pool);
+
+/**
+ * Releases the pool a few slabs at a time, for when freeing a large pool
+ * at once would take too long. Call it again until it returns true; the
+ * pool must not be used for anything else in between.
+ *
+ * @param *pool the pool to free
+ * @param *budget number of elements' worth of slabs that may be freed.
+ *      Each slab counts as the number of elements per slab, and the
+ *      amount spent is subtracted
+ *
+ * @return true once the pool has been freed completely
+ */
+bool pool_free_step(NodePool *pool, size_t *budget);
+
+/**
+ * Keeps every slab of another pool alive for as long as this pool
+ * exists, so that elements allocated from other can be handed over to
+ * this pool's owner and later passed to pool_release on this pool. The
+ * two pools can still be used independently, from different threads.
+ *
+ * @param *pool the pool that keeps the slabs alive
+ * @param *other the pool whose slabs are kept
+ *
+ * @return true if successful, false if allocation fails
+ */
+bool pool_keep(NodePool *pool, NodePool *other);
+
+/**
+ * Hands every slab of another pool over to this one, for when all of the
+ * elements other has given out are moving to this pool's owner. Other is
+ * left empty, with no elements in use, but can still be allocated from.
+ *
+ * @param *pool the pool that takes over the slabs
+ * @param *other the pool to empty
+ *
+ * @return true if successful, false if allocation fails, in which case
+ * neither pool is changed
+ */
+bool pool_adopt(NodePool *pool, NodePool *other);
+
+/**
+ * Hands out an element from the pool. Released elements are reused
+ * before new slab space is consumed.
+ *
+ * @param *pool the pool to allocate from
+ *
+ * @return pointer to an uninitialized element, or NULL if a new slab
+ * could not be allocated
+ */
+void *pool_alloc(NodePool *pool);
+
+/**
+ * Ensures that the next count allocations that do not come from the free
+ * list are carved consecutively out of a single slab, allocating a slab
+ * large enough to hold them if needed.
+ *
+ * @param *pool the pool to reserve space in
+ * @param count number of elements to reserve
+ *
+ * @return true if the space is available, false if allocation fails
+ */
+bool pool_reserve(NodePool *pool, size_t count);
+
+/**
+ * Hands out count consecutive elements carved from a single slab, never
+ * from the free list. They are spaced by the element size rounded up to
+ * a multiple of the pointer size, so they can be indexed as an array
+ * when the element type's size is already such a multiple.
+ *
+ * @param *pool the pool to allocate from
+ * @param count number of elements to allocate
+ *
+ * @return pointer to the first uninitialized element, or NULL if count
+ * is zero or a new slab could not be allocated
+ */
+void *pool_alloc_array(NodePool *pool, size_t count);
+
+/**
+ * Counts the bytes of slab storage the pool keeps alive, including
+ * slabs it only shares with other pools, released elements and space
+ * that has not been handed out yet.
+ *
+ * @param *pool the pool to measure
+ *
+ * @return number of bytes in the pool's slabs
+ */
+size_t pool_footprint(const NodePool *pool);
+
+/**
+ * Returns an element to the pool's free list for reuse.
+ *
+ * @param *pool the pool the element was allocated from
+ * @param *elem the element to release
+ */
+void pool_release(NodePool *pool, void *elem);
+
+#endif
@@ -0,0 +1,615 @@
+/**
+ * @file persistent.c
+ * @author Brian Gillespie
+ *
+ * Implementation of the persistent AVL tree. Every node is stamped with
+ * the write that created it. A writer may modify nodes carrying its own
+ * stamp, since no reader can have seen them yet, and must copy any other
+ * node before changing it. The node that was copied is retired.
+ *
+ * Reclamation: each reader publishes the global epoch in a slot of its
+ * own before loading the root, and clears the slot when it is done.
+ * Nodes retired by a write are tagged with the epoch current at the time,
+ * and the writer advances the epoch after publishing the new root. A
+ * reader that published a later epoch loaded the root after the swap, so
+ * it cannot reach those nodes. Retired nodes are therefore recycled once
+ * their tag is older than every published epoch.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "persistent.h"
+#include "avl.h"
+#include "nodepool.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/** Evaluates to the maximum of two values */
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/** Number of readers and snapshots that can be active at once */
+#define READER_SLOTS PERSISTENT_READERS
+
+/** Number of nodes per slab in the node pool */
+#define SLAB_NODES 4096
+
+/**
+ * Most nodes a single update can allocate: a copy of every node on the
+ * path, plus the children copied by a rotation at each level.
+ */
+#define MAX_UPDATE_NODES (3 * AVL_MAX_HEIGHT + 1)
+
+/**
+ * Defines a node in a persistent tree. Nodes are immutable once another
+ * thread can see them.
+ */
+typedef struct PNode {
+    /** Key for this node */
+    int key;
+    /** Height of this node */
+    int height;
+    /** Value stored in this node */
+    void *value;
+    /** Pointer to the left subtree */
+    struct PNode *left;
+    /** Pointer to the right subtree */
+    struct PNode *right;
+    /** While live, the write that created this node. Once retired, the
+        epoch in which it was retired */
+    unsigned long stamp;
+    /** Next node in the list of retired nodes */
+    struct PNode *retired;
+} PNode;
+
+/**
+ * Published epoch of one reader. Each slot has a cache line to itself so
+ * that readers on different cores do not contend.
+ */
+typedef struct ReaderSlot {
+    /** Epoch the reader entered in, or 0 if the slot is free */
+    atomic_ulong epoch;
+    /** Padding up to a cache line */
+    char pad[64 - sizeof(atomic_ulong)];
+} ReaderSlot;
+
+/** Defined in persistent.h */
+struct PersistentAVLTree {
+    /** Root of the current version */
+    _Atomic(PNode *) root;
+    /** Global epoch, advanced after every write */
+    atomic_ulong epoch;
+    /** Published epochs of active readers */
+    ReaderSlot readers[READER_SLOTS];
+    /** Serializes writers */
+    pthread_mutex_t writeLock;
+    /** Stamp of the write in progress */
+    unsigned long writes;
+    /** Storage for the nodes */
+    NodePool *pool;
+    /** Oldest retired node still waiting to be recycled */
+    PNode *retiredHead;
+    /** Newest retired node */
+    PNode *retiredTail;
+};
+
+/** Defined in persistent.h */
+struct PersistentSnapshot {
+    /** The tree this snapshot was taken of */
+    PersistentAVLTree *tree;
+    /** Reader slot this snapshot holds */
+    int slot;
+    /** Root of the version this snapshot sees */
+    const PNode *root;
+};
+
+/** Slot this thread last entered through, to start the next search */
+static _Thread_local unsigned slotHint;
+
+/* Static function prototypes */
+static int enterReader(PersistentAVLTree *tree);
+static void leaveReader(PersistentAVLTree *tree, int slot);
+static bool beginWrite(PersistentAVLTree *tree);
+static void endWrite(PersistentAVLTree *tree, PNode *root);
+static void retire(PersistentAVLTree *tree, PNode *node);
+static void reclaim(PersistentAVLTree *tree);
+static PNode *copyNode(PersistentAVLTree *tree, PNode *node);
+static PNode *mutableChild(PersistentAVLTree *tree, PNode **link);
+static int height(const PNode *node);
+static PNode *insert_path(PersistentAVLTree *tree, PNode *node, int key,
+                          void *value);
+static PNode *delete_path(PersistentAVLTree *tree, PNode *node, int key,
+                          void **value, bool *found);
+static PNode *remove_min(PersistentAVLTree *tree, PNode *node, PNode **min);
+static PNode *rebalance(PersistentAVLTree *tree, PNode *root);
+static PNode *rotateRight(PersistentAVLTree *tree, PNode *node);
+static PNode *rotateLeft(PersistentAVLTree *tree, PNode *node);
+static void *lookup(int key, const PNode *node);
+
+/** Documented in persistent.h */
+PersistentAVLTree *createPersistentAVLTree() {
+    PersistentAVLTree *tree = malloc(sizeof(PersistentAVLTree));
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->pool = createNodePool(sizeof(PNode), SLAB_NODES);
+    if (tree->pool == NULL) {
+        free(tree);
+        return NULL;
+    }
+    if (pthread_mutex_init(&tree->writeLock, NULL) != 0) {
+        freeNodePool(tree->pool);
+        free(tree);
+        return NULL;
+    }
+    atomic_init(&tree->root, NULL);
+    atomic_init(&tree->epoch, 1);
+    for (int i = 0; i < READER_SLOTS; i++) {
+        atomic_init(&tree->readers[i].epoch, 0);
+    }
+    tree->writes = 0;
+    tree->retiredHead = NULL;
+    tree->retiredTail = NULL;
+    return tree;
+}
+
+/** Documented in persistent.h */
+void freePersistentTree(PersistentAVLTree *tree) {
+    if (tree == NULL) {
+        return;
+    }
+    // Live and retired nodes alike are released with the pool
+    freeNodePool(tree->pool);
+    pthread_mutex_destroy(&tree->writeLock);
+    free(tree);
+}
+
+/**
+ * Claims a reader slot and publishes the current epoch in it. The epoch
+ * is read again after publishing, and republished until it is stable, so
+ * that a writer scanning the slots cannot miss this reader.
+ *
+ * @param *tree the tree to read
+ *
+ * @return index of the claimed slot
+ */
+static int enterReader(PersistentAVLTree *tree) {
+    unsigned slot = slotHint % READER_SLOTS;
+    while (true) {
+        unsigned long epoch = atomic_load(&tree->epoch);
+        for (int tries = 0; tries < READER_SLOTS; tries++) {
+            atomic_ulong *published = &tree->readers[slot].epoch;
+            unsigned long expected = 0;
+            if (atomic_compare_exchange_strong(published, &expected, epoch)) {
+                unsigned long current;
+                while ((current = atomic_load(&tree->epoch)) != epoch) {
+                    atomic_store(published, current);
+                    epoch = current;
+                }
+                slotHint = slot;
+                return (int) slot;
+            }
+            slot = (slot + 1) % READER_SLOTS;
+        }
+        // Every slot is busy; let another reader finish
+        sched_yield();
+    }
+}
+
+/**
+ * Releases a reader slot.
+ *
+ * @param *tree the tree that was read
+ * @param slot index of the slot to release
+ */
+static void leaveReader(PersistentAVLTree *tree, int slot) {
+    atomic_store(&tree->readers[slot].epoch, 0);
+}
+
+/**
+ * Starts a write: takes the writer mutex, makes sure the allocations of
+ * the update cannot fail halfway through, and picks a new stamp.
+ *
+ * @param *tree the tree to write to
+ *
+ * @return true if the write can go ahead, false if allocation failed
+ */
+static bool beginWrite(PersistentAVLTree *tree) {
+    pthread_mutex_lock(&tree->writeLock);
+    if (!pool_reserve(tree->pool, MAX_UPDATE_NODES)) {
+        pthread_mutex_unlock(&tree->writeLock);
+        return false;
+    }
+    tree->writes++;
+    return true;
+}
+
+/**
+ * Finishes a write: publishes the new root, advances the epoch, recycles
+ * whatever is no longer visible to any reader and releases the mutex.
+ *
+ * @param *tree the tree being written to
+ * @param *root root of the new version
+ */
+static void endWrite(PersistentAVLTree *tree, PNode *root) {
+    atomic_store(&tree->root, root);
+    atomic_fetch_add(&tree->epoch, 1);
+    reclaim(tree);
+    pthread_mutex_unlock(&tree->writeLock);
+}
+
+/**
+ * Queues a node that is no longer part of the newest version for
+ * recycling, tagged with the current epoch.
+ *
+ * @param *tree the tree the node belongs to
+ * @param *node the node to retire
+ */
+static void retire(PersistentAVLTree *tree, PNode *node) {
+    node->stamp = atomic_load_explicit(&tree->epoch, memory_order_relaxed);
+    node->retired = NULL;
+    if (tree->retiredTail) {
+        tree->retiredTail->retired = node;
+    } else {
+        tree->retiredHead = node;
+    }
+    tree->retiredTail = node;
+}
+
+/**
+ * Recycles retired nodes that were retired before the oldest epoch any
+ * active reader has published. Nodes are retired in epoch order, so the
+ * scan stops at the first node that is still needed.
+ *
+ * @param *tree the tree to reclaim from
+ */
+static void reclaim(PersistentAVLTree *tree) {
+    unsigned long oldest = ULONG_MAX;
+    for (int i = 0; i < READER_SLOTS; i++) {
+        unsigned long epoch = atomic_load(&tree->readers[i].epoch);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    while (tree->retiredHead && tree->retiredHead->stamp < oldest) {
+        PNode *node = tree->retiredHead;
+        tree->retiredHead = node->retired;
+        pool_release(tree->pool, node);
+    }
+    if (tree->retiredHead == NULL) {
+        tree->retiredTail = NULL;
+    }
+}
+
+/**
+ * Makes a private copy of a node for the write in progress and retires
+ * the original.
+ *
+ * @param *tree the tree being written to
+ * @param *node the node to copy
+ *
+ * @return the copy, which the writer may modify
+ */
+static PNode *copyNode(PersistentAVLTree *tree, PNode *node) {
+    PNode *copy = pool_alloc(tree->pool);
+    *copy = *node;
+    copy->stamp = tree->writes;
+    retire(tree, node);
+    return copy;
+}
+
+/**
+ * Makes sure the child stored in *link may be modified, copying it if an
+ * earlier version could still be using it.
+ *
+ * @param *tree the tree being written to
+ * @param **link the child pointer of a node private to this write
+ *
+ * @return the child, now private to this write
+ */
+static PNode *mutableChild(PersistentAVLTree *tree, PNode **link) {
+    if ((*link)->stamp != tree->writes) {
+        *link = copyNode(tree, *link);
+    }
+    return *link;
+}
+
+/**
+ * Returns the height field of the given node, or 0 if the node is NULL.
+ *
+ * @param *node the node to find the height of
+ *
+ * @return the height of the node
+ */
+static int height(const PNode *node) {
+    if (node == NULL) {
+        return 0;
+    }
+    return node->height;
+}
+
+/** Documented in persistent.h */
+bool insert_persistent(int key, void *value, PersistentAVLTree *tree) {
+    if (tree == NULL || !beginWrite(tree)) {
+        return false;
+    }
+    PNode *root = atomic_load_explicit(&tree->root, memory_order_relaxed);
+    endWrite(tree, insert_path(tree, root, key, value));
+    return true;
+}
+
+/**
+ * Inserts into the subtree by copying the path down to the key.
+ *
+ * @param *tree the tree being written to
+ * @param *node root of the subtree, which may be shared
+ * @param key key to insert
+ * @param *value value to insert
+ *
+ * @return root of the new version of the subtree
+ */
+static PNode *insert_path(PersistentAVLTree *tree, PNode *node, int key,
+                          void *value) {
+    if (node == NULL) {
+        PNode *leaf = pool_alloc(tree->pool);
+        *leaf = (PNode) { .key = key, .value = value, .height = 1,
+                          .left = NULL, .right = NULL,
+                          .stamp = tree->writes };
+        return leaf;
+    }
+
+    PNode *copy = copyNode(tree, node);
+    if (key < node->key) {
+        copy->left = insert_path(tree, node->left, key, value);
+    } else if (key > node->key) {
+        copy->right = insert_path(tree, node->right, key, value);
+    } else {
+        // update value in the copy of the existing node
+        copy->value = value;
+        return copy;
+    }
+    return rebalance(tree, copy);
+}
+
+/** Documented in persistent.h */
+void *delete_persistent(int key, PersistentAVLTree *tree) {
+    if (tree == NULL || !beginWrite(tree)) {
+        return NULL;
+    }
+    void *value = NULL;
+    bool found = false;
+    PNode *root = atomic_load_explicit(&tree->root, memory_order_relaxed);
+    endWrite(tree, delete_path(tree, root, key, &value, &found));
+    return value;
+}
+
+/**
+ * Deletes from the subtree by copying the path down to the key. Nothing
+ * is copied if the key is not found.
+ *
+ * @param *tree the tree being written to
+ * @param *node root of the subtree, which may be shared
+ * @param key key to delete
+ * @param **value set to the value of the deleted node, if it is found
+ * @param *found set to true if the key is found
+ *
+ * @return root of the new version of the subtree
+ */
+static PNode *delete_path(PersistentAVLTree *tree, PNode *node, int key,
+                          void **value, bool *found) {
+    if (node == NULL) {
+        return NULL;
+    }
+
+    if (key != node->key) {
+        bool left = key < node->key;
+        PNode *child = delete_path(tree, left ? node->left : node->right,
+                                   key, value, found);
+        if (!*found) {
+            return node;
+        }
+        PNode *copy = copyNode(tree, node);
+        if (left) {
+            copy->left = child;
+        } else {
+            copy->right = child;
+        }
+        return rebalance(tree, copy);
+    }
+
+    *found = true;
+    *value = node->value;
+    retire(tree, node);
+    if (node->left == NULL || node->right == NULL) {
+        return node->left ? node->left : node->right;
+    }
+    // A copy of the in-order successor takes the deleted node's place
+    PNode *successor;
+    PNode *right = remove_min(tree, node->right, &successor);
+    successor->left = node->left;
+    successor->right = right;
+    return rebalance(tree, successor);
+}
+
+/**
+ * Removes the node with the smallest key from a non-empty subtree by
+ * copying the path down to it.
+ *
+ * @param *tree the tree being written to
+ * @param *node root of the subtree, which may be shared
+ * @param **min set to a private copy of the removed node
+ *
+ * @return root of the new version of the subtree
+ */
+static PNode *remove_min(PersistentAVLTree *tree, PNode *node, PNode **min) {
+    if (node->left == NULL) {
+        *min = copyNode(tree, node);
+        return node->right;
+    }
+    PNode *copy = copyNode(tree, node);
+    copy->left = remove_min(tree, node->left, min);
+    return rebalance(tree, copy);
+}
+
+/**
+ * Updates the height of a private node and rotates it if its subtrees
+ * differ in height by more than one, as rebalance in avl.c does.
+ *
+ * @param *tree the tree being written to
+ * @param *root the node to rebalance, private to this write
+ *
+ * @return the new root of the subtree
+ */
+static PNode *rebalance(PersistentAVLTree *tree, PNode *root) {
+    root->height = 1 + MAX(height(root->left), height(root->right));
+    int balance = height(root->right) - height(root->left);
+
+    if (balance < -1) {
+        PNode *left = root->left;
+        if (height(left->right) > height(left->left)) {
+            left = mutableChild(tree, &root->left);
+            root->left = rotateLeft(tree, left);
+        }
+        return rotateRight(tree, root);
+    }
+
+    if (balance > 1) {
+        PNode *right = root->right;
+        if (height(right->left) > height(right->right)) {
+            right = mutableChild(tree, &root->right);
+            root->right = rotateRight(tree, right);
+        }
+        return rotateLeft(tree, root);
+    }
+
+    return root;
+}
+
+/**
+ * Performs a right rotation around a private node, copying its left
+ * child first if needed. See rotateRight in avl.c for a diagram.
+ *
+ * @param *tree the tree being written to
+ * @param *node the node to rotate the tree around
+ *
+ * @return the new root of the subtree
+ */
+static PNode *rotateRight(PersistentAVLTree *tree, PNode *node) {
+    PNode *root = mutableChild(tree, &node->left);
+    node->left = root->right;
+    root->right = node;
+
+    node->height = 1 + MAX(height(node->left), height(node->right));
+    root->height = 1 + MAX(height(root->left), height(root->right));
+    return root;
+}
+
+/**
+ * Performs a left rotation around a private node, copying its right
+ * child first if needed. See rotateLeft in avl.c for a diagram.
+ *
+ * @param *tree the tree being written to
+ * @param *node the node to rotate the tree around
+ *
+ * @return the new root of the subtree
+ */
+static PNode *rotateLeft(PersistentAVLTree *tree, PNode *node) {
+    PNode *root = mutableChild(tree, &node->right);
+    node->right = root->left;
+    root->left = node;
+
+    node->height = 1 + MAX(height(node->left), height(node->right));
+    root->height = 1 + MAX(height(root->left), height(root->right));
+    return root;
+}
+
+/** Documented in persistent.h */
+void *lookup_persistent(int key, PersistentAVLTree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    int slot = enterReader(tree);
+    void *value = lookup(key, atomic_load(&tree->root));
+    leaveReader(tree, slot);
+    return value;
+}
+
+/**
+ * Internal function for looking up a value in a version of the tree.
+ *
+ * @param key the key to search for
+ * @param *node root of the version to search
+ *
+ * @return the value located at the given key or NULL if the key is not
+ * found
+ */
+static void *lookup(int key, const PNode *node) {
+    while (node) {
+        if (node->key == key) {
+            return node->value;
+        }
+        node = key < node->key ? node->left : node->right;
+    }
+    return NULL;
+}
+
+/** Documented in persistent.h */
+PersistentSnapshot *pavl_snapshot(PersistentAVLTree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    PersistentSnapshot *snapshot = malloc(sizeof(PersistentSnapshot));
+    if (snapshot) {
+        // The slot stays claimed until release, pinning this version
+        snapshot->tree = tree;
+        snapshot->slot = enterReader(tree);
+        snapshot->root = atomic_load(&tree->root);
+    }
+    return snapshot;
+}
+
+/** Documented in persistent.h */
+void pavl_release_snapshot(PersistentSnapshot *snapshot) {
+    if (snapshot == NULL) {
+        return;
+    }
+    leaveReader(snapshot->tree, snapshot->slot);
+    free(snapshot);
+}
+
+/** Documented in persistent.h */
+void *lookup_snapshot(int key, const PersistentSnapshot *snapshot) {
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    return lookup(key, snapshot->root);
+}
+
+/** Documented in persistent.h */
+size_t pavl_snapshot_for_each(const PersistentSnapshot *snapshot,
+                              AVLVisitor fn, void *ctx) {
+    if (snapshot == NULL) {
+        return 0;
+    }
+    const PNode *stack[AVL_MAX_HEIGHT];
+    int depth = 0;
+    size_t visited = 0;
+    const PNode *node = snapshot->root;
+    while (node || depth > 0) {
+        while (node) {
+            stack[depth++] = node;
+            node = node->left;
+        }
+        node = stack[--depth];
+        visited++;
+        if (!fn(node->key, node->value, ctx)) {
+            break;
+        }
+        node = node->right;
+    }
+    return visited;
+}
@@ -0,0 +1,136 @@
+/**
+ * @file persistent.h
+ * @author Brian Gillespie
+ *
+ * Prototypes for a persistent AVL tree whose readers take no lock. Updates
+ * never modify a node that readers can see. Instead each insertion or
+ * deletion copies the path from the root to the changed node, producing
+ * a new version of the tree that shares every untouched subtree with the
+ * old one, and then swaps the root pointer atomically. Readers therefore
+ * never wait for a writer and never see a half-finished rotation.
+ *
+ * Nodes replaced by an update are reclaimed once no reader that might
+ * still be looking at them remains, using epoch-based reclamation.
+ * Writers are serialized by a mutex. Up to PERSISTENT_READERS lookups
+ * and snapshots can be active on one tree at once; more simply wait
+ * their turn.
+ */
+
+#ifndef PERSISTENT_H
+#define PERSISTENT_H
+
+#include "avl.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Most lookups and snapshots that can be active on one tree at once */
+#define PERSISTENT_READERS 128
+
+/**
+ * Opaque handle to a persistent tree.
+ */
+typedef struct PersistentAVLTree PersistentAVLTree;
+
+/**
+ * Opaque handle to a point-in-time view of a persistent tree.
+ */
+typedef struct PersistentSnapshot PersistentSnapshot;
+
+/**
+ * Creates a new, empty persistent tree
+ *
+ * @return pointer to a new tree, or NULL if allocation fails
+ */
+PersistentAVLTree *createPersistentAVLTree();
+
+/**
+ * Frees all memory associated with the given tree. No other thread may
+ * be using the tree, and every snapshot must have been released.
+ *
+ * @param *tree the tree to free
+ */
+void freePersistentTree(PersistentAVLTree *tree);
+
+/**
+ * Inserts a new node into the tree, or updates the value of an existing
+ * key, by publishing a new version of the tree.
+ *
+ * @param key the key of this node
+ * @param *value pointer to the value to store
+ * @param *tree pointer to the tree to insert into
+ *
+ * @return true if the insertion is successful, false if allocation fails
+ */
+bool insert_persistent(int key, void *value, PersistentAVLTree *tree);
+
+/**
+ * Removes a node from the tree based on its key and returns its value,
+ * by publishing a new version of the tree.
+ *
+ * @param key the key of the node to remove
+ * @param *tree the tree to delete from
+ *
+ * @return pointer to the value of the deleted node, or NULL if the key
+ * was not found, or if allocation fails.
+ */
+void *delete_persistent(int key, PersistentAVLTree *tree);
+
+/**
+ * Locates the key in the current version of the tree and returns a
+ * pointer to the value. Never waits for a writer, even while one is
+ * updating the tree, but waits for a reader to finish if
+ * PERSISTENT_READERS are already active.
+ *
+ * @param key the key to search for
+ * @param *tree the tree to search
+ *
+ * @return pointer to the value stored at the key, or NULL if the key was
+ * not found.
+ */
+void *lookup_persistent(int key, PersistentAVLTree *tree);
+
+/**
+ * Takes a snapshot of the current version of the tree. The snapshot
+ * stays unchanged while writers keep updating the tree, at the cost of
+ * holding back reclamation of the nodes it can see, so release it as
+ * soon as it is no longer needed.
+ *
+ * @param *tree the tree to snapshot
+ *
+ * @return pointer to the snapshot, or NULL if allocation fails
+ */
+PersistentSnapshot *pavl_snapshot(PersistentAVLTree *tree);
+
+/**
+ * Releases a snapshot, allowing the nodes only it could see to be
+ * reclaimed.
+ *
+ * @param *snapshot the snapshot to release
+ */
+void pavl_release_snapshot(PersistentSnapshot *snapshot);
+
+/**
+ * Locates the key in a snapshot and returns a pointer to the value.
+ *
+ * @param key the key to search for
+ * @param *snapshot the snapshot to search
+ *
+ * @return pointer to the value stored at the key when the snapshot was
+ * taken, or NULL if the key was not found.
+ */
+void *lookup_snapshot(int key, const PersistentSnapshot *snapshot);
+
+/**
+ * Calls fn for every key in a snapshot, in ascending key order.
+ *
+ * @param *snapshot the snapshot to walk
+ * @param fn the function to call for each node; returning false stops
+ *      the walk
+ * @param *ctx context pointer passed through to fn
+ *
+ * @return number of nodes fn was called for
+ */
+size_t pavl_snapshot_for_each(const PersistentSnapshot *snapshot,
+                              AVLVisitor fn, void *ctx);
+
+#endif
@@ -0,0 +1,258 @@
+/**
+ * @file serial.c
+ * @author Brian Gillespie
+ *
+ * Implementation of tree streams. A stream starts with a magic number
+ * and the key count. The first key follows, zigzag encoded so small
+ * negative keys stay short, then each later key as the gap from the one
+ * before minus one, since keys are strictly ascending. Every key is
+ * followed directly by its value payload, if there is one.
+ */
+
+#include "serial.h"
+#include "avl.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Identifies a tree stream and its version */
+#define STREAM_MAGIC UINT64_C(0x31534C5641)
+
+/** Bytes buffered between calls to the sink or source */
+#define STREAM_BUFFER 4096
+
+/** Number of keys to make room for before the stream proves longer */
+#define INITIAL_KEYS 65536
+
+/** Defined in serial.h */
+struct AVLStream {
+    /** Function receiving written bytes, or NULL when reading */
+    AVLSink sink;
+    /** Function supplying read bytes, or NULL when writing */
+    AVLSource source;
+    /** Context pointer for the sink or source */
+    void *ctx;
+    /** Index of the next byte to write or read in the buffer */
+    size_t pos;
+    /** Number of bytes in the buffer that can be read */
+    size_t length;
+    /** Buffered bytes */
+    unsigned char buffer[STREAM_BUFFER];
+};
+
+/* Static function prototypes */
+static bool flush(AVLStream *out);
+static bool fill(AVLStream *in);
+
+/** Documented in serial.h */
+bool avl_serialize(AVLTree *tree, AVLSink sink, AVLValueEncoder encode,
+                   void *ctx) {
+    if (tree == NULL || sink == NULL) {
+        return false;
+    }
+    AVLStream *out = malloc(sizeof(AVLStream));
+    if (out == NULL) {
+        return false;
+    }
+    *out = (AVLStream) { .sink = sink, .ctx = ctx };
+
+    avl_read_lock(tree);
+    bool ok = avl_stream_put_varint(out, STREAM_MAGIC) &&
+              avl_stream_put_varint(out, tree->count);
+    AVLIter iter;
+    int key, prev = 0;
+    void *value;
+    bool first = true;
+    avl_iter_first(&iter, tree);
+    while (ok && avl_iter_get(&iter, &key, &value)) {
+        uint64_t code;
+        if (first) {
+            code = key < 0 ? ((uint64_t) -(int64_t) key << 1) - 1
+                           : (uint64_t) key << 1;
+            first = false;
+        } else {
+            code = (uint32_t) key - (uint32_t) prev - 1;
+        }
+        prev = key;
+        ok = avl_stream_put_varint(out, code) &&
+             (encode == NULL || encode(out, value, ctx));
+        avl_iter_next(&iter);
+    }
+    avl_unlock(tree);
+
+    ok = ok && flush(out);
+    free(out);
+    return ok;
+}
+
+/** Documented in serial.h */
+AVLTree *avl_deserialize(AVLSource source, AVLValueDecoder decode,
+                         void *ctx) {
+    if (source == NULL) {
+        return NULL;
+    }
+    AVLStream *in = malloc(sizeof(AVLStream));
+    if (in == NULL) {
+        return NULL;
+    }
+    *in = (AVLStream) { .source = source, .ctx = ctx };
+
+    uint64_t magic, count;
+    if (!avl_stream_get_varint(in, &magic) || magic != STREAM_MAGIC ||
+        !avl_stream_get_varint(in, &count) || count > SIZE_MAX) {
+        free(in);
+        return NULL;
+    }
+
+    /* The count comes from outside, so the arrays only grow as the keys
+        actually arrive. */
+    size_t room = count < INITIAL_KEYS ? count : INITIAL_KEYS;
+    int *keys = malloc(room * sizeof(int) + 1);
+    void **values = decode ? malloc(room * sizeof(void *) + 1) : NULL;
+    bool ok = keys && (decode == NULL || values);
+    int64_t prev = 0;
+    for (size_t i = 0; i < count && ok; i++) {
+        if (i == room) {
+            room = count - room < room ? count : 2 * room;
+            int *moreKeys = realloc(keys, room * sizeof(int));
+            void **moreValues = decode ? realloc(values,
+                                                 room * sizeof(void *))
+                                       : NULL;
+            keys = moreKeys ? moreKeys : keys;
+            values = moreValues ? moreValues : values;
+            ok = moreKeys && (decode == NULL || moreValues);
+        }
+        uint64_t code;
+        ok = ok && avl_stream_get_varint(in, &code);
+        if (ok) {
+            int64_t key;
+            if (i == 0) {
+                key = code & 1 ? -(int64_t) (code >> 1) - 1
+                               : (int64_t) (code >> 1);
+            } else {
+                key = code <= UINT32_MAX ? prev + 1 + (int64_t) code
+                                         : INT64_MAX;
+            }
+            ok = key >= INT_MIN && key <= INT_MAX;
+            keys[i] = (int) key;
+            prev = key;
+        }
+        ok = ok && (decode == NULL || decode(in, &values[i], ctx));
+    }
+
+    AVLTree *tree = ok ? avl_build_from_sorted(keys, values, count) : NULL;
+    free(keys);
+    free(values);
+    free(in);
+    return tree;
+}
+
+/** Documented in serial.h */
+bool avl_stream_put(AVLStream *out, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    while (length > 0) {
+        if (out->pos == STREAM_BUFFER && !flush(out)) {
+            return false;
+        }
+        size_t chunk = STREAM_BUFFER - out->pos;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(out->buffer + out->pos, bytes, chunk);
+        out->pos += chunk;
+        bytes += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+/** Documented in serial.h */
+bool avl_stream_put_varint(AVLStream *out, uint64_t number) {
+    unsigned char bytes[10];
+    size_t length = 0;
+    while (number >= 0x80) {
+        bytes[length++] = (unsigned char) (number | 0x80);
+        number >>= 7;
+    }
+    bytes[length++] = (unsigned char) number;
+    return avl_stream_put(out, bytes, length);
+}
+
+/**
+ * Passes the buffered bytes of a stream being written to its sink.
+ *
+ * @param *out the stream to flush
+ *
+ * @return true if the sink accepted the bytes
+ */
+static bool flush(AVLStream *out) {
+    if (out->pos > 0 && !out->sink(out->buffer, out->pos, out->ctx)) {
+        return false;
+    }
+    out->pos = 0;
+    return true;
+}
+
+/** Documented in serial.h */
+bool avl_stream_get(AVLStream *in, void *data, size_t length) {
+    unsigned char *bytes = data;
+    while (length > 0) {
+        if (in->pos == in->length && !fill(in)) {
+            return false;
+        }
+        size_t chunk = in->length - in->pos;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(bytes, in->buffer + in->pos, chunk);
+        in->pos += chunk;
+        bytes += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+/** Documented in serial.h */
+bool avl_stream_get_varint(AVLStream *in, uint64_t *number) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (in->pos == in->length && !fill(in)) {
+            return false;
+        }
+        unsigned char byte = in->buffer[in->pos++];
+        result |= (uint64_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            *number = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Refills the buffer of a stream being read from its source.
+ *
+ * @param *in the stream to refill
+ *
+ * @return true if at least one byte was read
+ */
+static bool fill(AVLStream *in) {
+    in->pos = 0;
+    in->length = in->source(in->buffer, STREAM_BUFFER, in->ctx);
+    if (in->length > STREAM_BUFFER) {
+        in->length = 0;
+    }
+    return in->length > 0;
+}
+
+/** Documented in serial.h */
+bool avl_file_sink(const void *data, size_t length, void *ctx) {
+    return fwrite(data, 1, length, ctx) == length;
+}
+
+/** Documented in serial.h */
+size_t avl_file_source(void *data, size_t length, void *ctx) {
+    return fread(data, 1, length, ctx);
+}
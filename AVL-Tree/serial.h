@@ -0,0 +1,144 @@
+/**
+ * @file serial.h
+ * @author Brian Gillespie
+ *
+ * Prototypes for streaming an AVL tree to and from a compact binary
+ * format, for example to replicate it over the network. Keys are written
+ * in ascending order as varint-encoded gaps from the previous key, so
+ * dense key sets take about one byte per key. Each key may be followed
+ * by a value payload, which the caller writes and reads back through
+ * callbacks. Reading builds the tree with avl_build_from_sorted, so both
+ * directions take O(n) time.
+ *
+ * Bytes pass through a caller-supplied sink or source function, in
+ * blocks, so a stream never has to fit in memory.
+ */
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "avl.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Opaque handle to a stream being written or read. Passed to the value
+ * callbacks so they can add or take payload bytes.
+ */
+typedef struct AVLStream AVLStream;
+
+/**
+ * Receives the next bytes of a stream being written.
+ *
+ * @return true if the bytes were accepted, false to abandon the stream
+ */
+typedef bool (*AVLSink)(const void *data, size_t length, void *ctx);
+
+/**
+ * Supplies the next bytes of a stream being read.
+ *
+ * @return number of bytes stored in data, at most length. Returning 0
+ * means the stream has ended
+ */
+typedef size_t (*AVLSource)(void *data, size_t length, void *ctx);
+
+/**
+ * Writes the payload for one value, using avl_stream_put and
+ * avl_stream_put_varint.
+ *
+ * @return true if successful, false to abandon the stream
+ */
+typedef bool (*AVLValueEncoder)(AVLStream *out, void *value, void *ctx);
+
+/**
+ * Reads back the payload written by the matching encoder, using
+ * avl_stream_get and avl_stream_get_varint.
+ *
+ * @return true if successful, false if the payload is invalid
+ */
+typedef bool (*AVLValueDecoder)(AVLStream *in, void **value, void *ctx);
+
+/**
+ * Writes every key of the tree, with its value payload, to a sink. A
+ * concurrent tree is read locked for the whole stream.
+ *
+ * @param *tree the tree to write
+ * @param sink function receiving the bytes
+ * @param encode function writing each value, or NULL to write keys only
+ * @param *ctx context pointer passed through to sink and encode
+ *
+ * @return true if the whole stream was written
+ */
+bool avl_serialize(AVLTree *tree, AVLSink sink, AVLValueEncoder encode,
+                   void *ctx);
+
+/**
+ * Reads a stream written by avl_serialize and builds a new tree from it.
+ *
+ * @param source function supplying the bytes
+ * @param decode function reading each value, or NULL if the stream was
+ *      written without values. Then every value is NULL
+ * @param *ctx context pointer passed through to source and decode
+ *
+ * @return pointer to the new tree, or NULL if the stream is invalid or
+ * allocation fails. Values already decoded are not freed on failure
+ */
+AVLTree *avl_deserialize(AVLSource source, AVLValueDecoder decode,
+                         void *ctx);
+
+/**
+ * Appends bytes to a stream being written.
+ *
+ * @param *out the stream to write to
+ * @param *data the bytes to write
+ * @param length number of bytes to write
+ *
+ * @return true if successful, false if the sink failed
+ */
+bool avl_stream_put(AVLStream *out, const void *data, size_t length);
+
+/**
+ * Appends an unsigned integer in 1 to 10 bytes, using fewer for smaller
+ * numbers.
+ *
+ * @param *out the stream to write to
+ * @param number the number to write
+ *
+ * @return true if successful, false if the sink failed
+ */
+bool avl_stream_put_varint(AVLStream *out, uint64_t number);
+
+/**
+ * Takes the next bytes from a stream being read.
+ *
+ * @param *in the stream to read from
+ * @param *data where to store the bytes
+ * @param length number of bytes to read
+ *
+ * @return true if successful, false if the stream ended first
+ */
+bool avl_stream_get(AVLStream *in, void *data, size_t length);
+
+/**
+ * Takes an integer written by avl_stream_put_varint.
+ *
+ * @param *in the stream to read from
+ * @param *number set to the number read
+ *
+ * @return true if successful, false if the stream ended first or the
+ * encoding is invalid
+ */
+bool avl_stream_get_varint(AVLStream *in, uint64_t *number);
+
+/**
+ * An AVLSink that writes to the FILE * given as ctx.
+ */
+bool avl_file_sink(const void *data, size_t length, void *ctx);
+
+/**
+ * An AVLSource that reads from the FILE * given as ctx.
+ */
+size_t avl_file_source(void *data, size_t length, void *ctx);
+
+#endif
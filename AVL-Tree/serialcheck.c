@@ -0,0 +1,173 @@
+/**
+ * @file serialcheck.c
+ * @author Brian Gillespie
+ *
+ * Round-trip check for tree streams. Serializes a range of trees into
+ * memory, reads each one back and compares every key and value with the
+ * original. Exits with a nonzero status if any tree does not survive.
+ */
+
+#include "avl.h"
+#include "serial.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * A growable byte buffer that a stream is written to and read back from.
+ */
+typedef struct Buffer {
+    /** The bytes written so far */
+    unsigned char *data;
+    /** Number of bytes written */
+    size_t length;
+    /** Number of bytes allocated */
+    size_t room;
+    /** Index of the next byte to read */
+    size_t pos;
+} Buffer;
+
+/* Static function prototypes */
+static bool buffer_sink(const void *data, size_t length, void *ctx);
+static size_t buffer_source(void *data, size_t length, void *ctx);
+static bool encode_value(AVLStream *out, void *value, void *ctx);
+static bool decode_value(AVLStream *in, void **value, void *ctx);
+static bool round_trip(const char *name, const int *keys, size_t n,
+                       bool values);
+
+/**
+ * Checks empty and single-key trees, the extreme keys, gaps too large
+ * for an int and trees long enough to span many stream buffers.
+ */
+int main() {
+    static const int single[] = { 42 };
+    static const int extremes[] = { INT_MIN, INT_MAX };
+    static const int gaps[] = { INT_MIN, -2000000000, -1, 0, 1,
+                                2000000000, INT_MAX };
+    bool ok = round_trip("empty", NULL, 0, false) &&
+              round_trip("single", single, 1, true) &&
+              round_trip("extremes", extremes, 2, true) &&
+              round_trip("large gaps", gaps, 7, true);
+
+    size_t n = 100000;
+    int *dense = malloc(n * sizeof(int));
+    if (dense == NULL) {
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < n; i++) {
+        dense[i] = (int) (3 * i) - 150000;
+    }
+    ok = ok && round_trip("dense keys", dense, n, false) &&
+         round_trip("dense values", dense, n, true);
+    free(dense);
+
+    printf("serial round trip %s\n", ok ? "passed" : "FAILED");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Builds a tree from keys, writes it out and reads it back. Each value
+ * is the key's index plus one, written as a varint payload.
+ *
+ * @param *name name of the case, printed if it fails
+ * @param *keys keys of the tree, in ascending order
+ * @param n number of keys
+ * @param values whether to write value payloads
+ *
+ * @return true if the tree read back matches the original
+ */
+static bool round_trip(const char *name, const int *keys, size_t n,
+                       bool values) {
+    void **stored = malloc(n * sizeof(void *) + 1);
+    if (stored == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        stored[i] = (void *) (uintptr_t) (i + 1);
+    }
+    AVLTree *tree = avl_build_from_sorted(keys, values ? stored : NULL, n);
+    Buffer buffer = { .data = NULL };
+    bool ok = tree &&
+              avl_serialize(tree, buffer_sink, values ? encode_value : NULL,
+                            &buffer);
+    AVLTree *copy = ok ? avl_deserialize(buffer_source,
+                                         values ? decode_value : NULL,
+                                         &buffer)
+                       : NULL;
+
+    ok = copy && copy->count == n;
+    AVLIter iter;
+    int key;
+    void *value;
+    avl_iter_first(&iter, copy);
+    for (size_t i = 0; ok && i < n; i++) {
+        ok = avl_iter_get(&iter, &key, &value) && key == keys[i] &&
+             value == (values ? stored[i] : NULL);
+        avl_iter_next(&iter);
+    }
+    if (!ok) {
+        printf("%s: tree did not survive the round trip\n", name);
+    }
+    freeTree(copy);
+    freeTree(tree);
+    free(buffer.data);
+    free(stored);
+    return ok;
+}
+
+/**
+ * Appends bytes to a Buffer.
+ */
+static bool buffer_sink(const void *data, size_t length, void *ctx) {
+    Buffer *buffer = ctx;
+    if (buffer->length + length > buffer->room) {
+        size_t room = 2 * (buffer->length + length);
+        unsigned char *more = realloc(buffer->data, room);
+        if (more == NULL) {
+            return false;
+        }
+        buffer->data = more;
+        buffer->room = room;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return true;
+}
+
+/**
+ * Reads back the bytes of a Buffer.
+ */
+static size_t buffer_source(void *data, size_t length, void *ctx) {
+    Buffer *buffer = ctx;
+    size_t left = buffer->length - buffer->pos;
+    if (length > left) {
+        length = left;
+    }
+    memcpy(data, buffer->data + buffer->pos, length);
+    buffer->pos += length;
+    return length;
+}
+
+/**
+ * Writes a value, which holds a small number, as a varint.
+ */
+static bool encode_value(AVLStream *out, void *value, void *ctx) {
+    (void) ctx;
+    return avl_stream_put_varint(out, (uintptr_t) value);
+}
+
+/**
+ * Reads back a value written by encode_value.
+ */
+static bool decode_value(AVLStream *in, void **value, void *ctx) {
+    (void) ctx;
+    uint64_t number;
+    if (!avl_stream_get_varint(in, &number) || number > UINTPTR_MAX) {
+        return false;
+    }
+    *value = (void *) (uintptr_t) number;
+    return true;
+}
@@ -0,0 +1,235 @@
+/**
+ * @file sharded.c
+ * @author Brian Gillespie
+ *
+ * Implementation of the sharded map. Each shard is an AVLTree created in
+ * concurrent arena mode. Keys are hashed multiplicatively so that runs
+ * of sequential keys, such as IDs, are spread across every shard instead
+ * of piling into one.
+ *
+ * An ordered scan keeps one AVLIter per shard and a binary min-heap of
+ * the shards ordered by the key each iterator is on. Each step pops the
+ * smallest key, advances that shard and sifts it back down, so a scan of
+ * k keys costs O(k log s) for s shards on top of the initial seeks.
+ */
+
+#include "sharded.h"
+#include "avl.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Defined in sharded.h */
+struct ShardedAVLMap {
+    /** Number of shards */
+    size_t count;
+    /** The shards */
+    AVLTree **shards;
+};
+
+/** Defined in sharded.h */
+struct ShardedIter {
+    /** The map being scanned */
+    ShardedAVLMap *map;
+    /** One iterator per shard */
+    AVLIter *iters;
+    /** Key each iterator in the heap is on */
+    int *keys;
+    /** Min-heap of shard indices, ordered by keys */
+    size_t *heap;
+    /** Number of shards in the heap that still have keys */
+    size_t size;
+};
+
+/* Static function prototypes */
+static AVLTree *shardFor(ShardedAVLMap *map, int key);
+static void siftDown(ShardedIter *iter, size_t pos);
+
+/** Documented in sharded.h */
+ShardedAVLMap *createShardedAVLMap(size_t shards) {
+    if (shards == 0) {
+        return NULL;
+    }
+    ShardedAVLMap *map = malloc(sizeof(ShardedAVLMap));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->shards = calloc(shards, sizeof(AVLTree *));
+    if (map->shards == NULL) {
+        free(map);
+        return NULL;
+    }
+    map->count = shards;
+
+    AVLTreeOptions options = { .arena = true, .concurrent = true };
+    for (size_t i = 0; i < shards; i++) {
+        map->shards[i] = createAVLTreeWithOptions(&options);
+        if (map->shards[i] == NULL) {
+            freeShardedMap(map);
+            return NULL;
+        }
+    }
+    return map;
+}
+
+/** Documented in sharded.h */
+void freeShardedMap(ShardedAVLMap *map) {
+    if (map == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < map->count; i++) {
+        freeTree(map->shards[i]);
+    }
+    free(map->shards);
+    free(map);
+}
+
+/**
+ * Picks the shard that owns a key. The key is scrambled with a Fibonacci
+ * hash and the high bits are scaled onto the shard range.
+ *
+ * @param *map the map to pick from
+ * @param key the key to place
+ *
+ * @return the shard that owns key
+ */
+static AVLTree *shardFor(ShardedAVLMap *map, int key) {
+    uint32_t hash = (uint32_t) key * 2654435769u;
+    return map->shards[((uint64_t) hash * map->count) >> 32];
+}
+
+/** Documented in sharded.h */
+bool insert_sharded(int key, void *value, ShardedAVLMap *map) {
+    if (map == NULL) {
+        return false;
+    }
+    return insert_avl(key, value, shardFor(map, key));
+}
+
+/** Documented in sharded.h */
+void *delete_sharded(int key, ShardedAVLMap *map) {
+    if (map == NULL) {
+        return NULL;
+    }
+    return delete_avl(key, shardFor(map, key));
+}
+
+/** Documented in sharded.h */
+void *lookup_sharded(int key, ShardedAVLMap *map) {
+    if (map == NULL) {
+        return NULL;
+    }
+    return lookup_avl(key, shardFor(map, key));
+}
+
+/** Documented in sharded.h */
+size_t sharded_count(ShardedAVLMap *map) {
+    if (map == NULL) {
+        return 0;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < map->count; i++) {
+        avl_read_lock(map->shards[i]);
+        count += map->shards[i]->count;
+        avl_unlock(map->shards[i]);
+    }
+    return count;
+}
+
+/** Documented in sharded.h */
+ShardedIter *sharded_iter_open(ShardedAVLMap *map, int lo) {
+    if (map == NULL) {
+        return NULL;
+    }
+    ShardedIter *iter = malloc(sizeof(ShardedIter));
+    if (iter == NULL) {
+        return NULL;
+    }
+    iter->map = map;
+    iter->iters = malloc(map->count * sizeof(AVLIter));
+    iter->keys = malloc(map->count * sizeof(int));
+    iter->heap = malloc(map->count * sizeof(size_t));
+    if (!iter->iters || !iter->keys || !iter->heap) {
+        free(iter->iters);
+        free(iter->keys);
+        free(iter->heap);
+        free(iter);
+        return NULL;
+    }
+
+    // Locks are always taken in shard order, so two scans cannot deadlock
+    iter->size = 0;
+    for (size_t i = 0; i < map->count; i++) {
+        avl_read_lock(map->shards[i]);
+        if (avl_iter_seek(&iter->iters[i], map->shards[i], lo)) {
+            avl_iter_get(&iter->iters[i], &iter->keys[i], NULL);
+            iter->heap[iter->size++] = i;
+        }
+    }
+    for (size_t pos = iter->size / 2; pos-- > 0; ) {
+        siftDown(iter, pos);
+    }
+    return iter;
+}
+
+/** Documented in sharded.h */
+bool sharded_iter_next(ShardedIter *iter, int *key, void **value) {
+    if (iter == NULL || iter->size == 0) {
+        return false;
+    }
+    size_t shard = iter->heap[0];
+    avl_iter_get(&iter->iters[shard], key, value);
+
+    if (avl_iter_next(&iter->iters[shard])) {
+        avl_iter_get(&iter->iters[shard], &iter->keys[shard], NULL);
+    } else {
+        iter->heap[0] = iter->heap[--iter->size];
+    }
+    siftDown(iter, 0);
+    return true;
+}
+
+/**
+ * Moves the shard at a heap position down until neither child has a
+ * smaller key.
+ *
+ * @param *iter the scan whose heap to fix
+ * @param pos position in the heap to start from
+ */
+static void siftDown(ShardedIter *iter, size_t pos) {
+    size_t *heap = iter->heap;
+    const int *keys = iter->keys;
+    while (true) {
+        size_t smallest = pos;
+        size_t left = 2 * pos + 1;
+        size_t right = left + 1;
+        if (left < iter->size && keys[heap[left]] < keys[heap[smallest]]) {
+            smallest = left;
+        }
+        if (right < iter->size && keys[heap[right]] < keys[heap[smallest]]) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            return;
+        }
+        size_t swap = heap[pos];
+        heap[pos] = heap[smallest];
+        heap[smallest] = swap;
+        pos = smallest;
+    }
+}
+
+/** Documented in sharded.h */
+void sharded_iter_close(ShardedIter *iter) {
+    if (iter == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < iter->map->count; i++) {
+        avl_unlock(iter->map->shards[i]);
+    }
+    free(iter->iters);
+    free(iter->keys);
+    free(iter->heap);
+    free(iter);
+}
@@ -0,0 +1,121 @@
+/**
+ * @file sharded.h
+ * @author Brian Gillespie
+ *
+ * Prototypes for a sharded map built from several concurrent AVL trees.
+ * Keys are spread over the shards by hash, and every shard has its own
+ * lock and node arena, so writers working on different shards never wait
+ * for each other. Ordered scans merge the shards back into key order.
+ */
+
+#ifndef SHARDED_H
+#define SHARDED_H
+
+#include "avl.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Opaque handle to a sharded map.
+ */
+typedef struct ShardedAVLMap ShardedAVLMap;
+
+/**
+ * Opaque handle to an ordered scan over every shard of a map.
+ */
+typedef struct ShardedIter ShardedIter;
+
+/**
+ * Creates a new, empty sharded map.
+ *
+ * @param shards number of shards; a small multiple of the number of
+ *      writer threads works well
+ *
+ * @return pointer to a new map, or NULL if shards is 0 or allocation
+ * fails
+ */
+ShardedAVLMap *createShardedAVLMap(size_t shards);
+
+/**
+ * Frees all memory associated with the given map. No other thread may be
+ * using it.
+ *
+ * @param *map the map to free
+ */
+void freeShardedMap(ShardedAVLMap *map);
+
+/**
+ * Inserts a key into the shard that owns it, or updates its value.
+ *
+ * @param key the key to insert
+ * @param *value pointer to the value to store
+ * @param *map pointer to the map to insert into
+ *
+ * @return true if the insertion is successful
+ */
+bool insert_sharded(int key, void *value, ShardedAVLMap *map);
+
+/**
+ * Removes a key from the map and returns its value.
+ *
+ * @param key the key to remove
+ * @param *map the map to delete from
+ *
+ * @return pointer to the value of the deleted key, or NULL if the key
+ * was not found.
+ */
+void *delete_sharded(int key, ShardedAVLMap *map);
+
+/**
+ * Locates the key in the map and returns a pointer to the value.
+ *
+ * @param key the key to search for
+ * @param *map the map to search
+ *
+ * @return pointer to the value stored at the key, or NULL if the key was
+ * not found.
+ */
+void *lookup_sharded(int key, ShardedAVLMap *map);
+
+/**
+ * Counts the keys in the map. Under concurrent writes the count is only
+ * a momentary estimate, since shards are counted one at a time.
+ *
+ * @param *map the map to count
+ *
+ * @return number of keys in the map
+ */
+size_t sharded_count(ShardedAVLMap *map);
+
+/**
+ * Starts an ordered scan of every key greater than or equal to lo. The
+ * scan holds the read lock of every shard until it is closed, so writers
+ * wait while it is open.
+ *
+ * @param *map the map to scan
+ * @param lo smallest key to return
+ *
+ * @return pointer to the scan, or NULL if allocation fails
+ */
+ShardedIter *sharded_iter_open(ShardedAVLMap *map, int lo);
+
+/**
+ * Returns the next key of a scan, in ascending key order across all
+ * shards.
+ *
+ * @param *iter the scan to advance
+ * @param *key set to the next key, if not NULL
+ * @param **value set to the value of the next key, if not NULL
+ *
+ * @return true if a key was returned, false if the scan is finished
+ */
+bool sharded_iter_next(ShardedIter *iter, int *key, void **value);
+
+/**
+ * Ends a scan and releases the locks it holds.
+ *
+ * @param *iter the scan to close
+ */
+void sharded_iter_close(ShardedIter *iter);
+
+#endif
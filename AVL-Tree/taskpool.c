@@ -0,0 +1,163 @@
+/**
+ * @file taskpool.c
+ * @author Brian Gillespie
+ *
+ * Implementation of a fork-join thread pool. Queued tasks are kept on a
+ * single stack guarded by a mutex, so the most recently spawned task,
+ * which in recursive code is the smallest and the one about to be
+ * waited for, is run first. The tasks this pool is meant for are large
+ * enough that contention on the one lock is not a concern.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "taskpool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/** States of a task */
+enum { TASK_QUEUED, TASK_RUNNING, TASK_DONE };
+
+/** Defined in taskpool.h */
+struct TaskPool {
+    /** Guards the queue and the state of every task */
+    pthread_mutex_t lock;
+    /** Signalled when a task is queued or the pool is stopping */
+    pthread_cond_t queued;
+    /** Broadcast when a task finishes */
+    pthread_cond_t finished;
+    /** Queued tasks, most recently spawned first */
+    Task *queue;
+    /** Set when the workers should exit */
+    bool stopping;
+    /** Number of worker threads started */
+    int workers;
+    /** Worker thread handles */
+    pthread_t threads[];
+};
+
+/* Static function prototypes */
+static void *worker(void *arg);
+static void run(TaskPool *pool, Task *task);
+
+/** Documented in taskpool.h */
+TaskPool *createTaskPool(int workers) {
+    if (workers < 0) {
+        workers = 0;
+    }
+    TaskPool *pool = malloc(sizeof(TaskPool) + workers * sizeof(pthread_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    pool->queue = NULL;
+    pool->stopping = false;
+    pool->workers = 0;
+    while (pool->workers < workers) {
+        if (pthread_create(&pool->threads[pool->workers], NULL,
+                           worker, pool) != 0) {
+            freeTaskPool(pool);
+            return NULL;
+        }
+        pool->workers++;
+    }
+    return pool;
+}
+
+/** Documented in taskpool.h */
+void freeTaskPool(TaskPool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->queued);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/**
+ * Main loop of a worker thread. Runs queued tasks until the pool stops.
+ *
+ * @param *arg the pool the worker belongs to
+ *
+ * @return NULL
+ */
+static void *worker(void *arg) {
+    TaskPool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping) {
+        Task *task = pool->queue;
+        if (task == NULL) {
+            pthread_cond_wait(&pool->queued, &pool->lock);
+            continue;
+        }
+        pool->queue = task->next;
+        run(pool, task);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * Runs a task that has just been taken off the queue. Called and
+ * returns with the pool lock held, but drops it while the task runs.
+ *
+ * @param *pool the pool the task belongs to
+ * @param *task the task to run
+ */
+static void run(TaskPool *pool, Task *task) {
+    task->state = TASK_RUNNING;
+    pthread_mutex_unlock(&pool->lock);
+    task->fn(task->arg);
+    pthread_mutex_lock(&pool->lock);
+    task->state = TASK_DONE;
+    pthread_cond_broadcast(&pool->finished);
+}
+
+/** Documented in taskpool.h */
+void task_spawn(TaskPool *pool, Task *task, void (*fn)(void *arg),
+                void *arg) {
+    task->fn = fn;
+    task->arg = arg;
+    task->state = TASK_QUEUED;
+    pthread_mutex_lock(&pool->lock);
+    task->next = pool->queue;
+    pool->queue = task;
+    pthread_cond_signal(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/** Documented in taskpool.h */
+void task_wait(TaskPool *pool, Task *task) {
+    pthread_mutex_lock(&pool->lock);
+    while (task->state != TASK_DONE) {
+        Task *next = pool->queue;
+        if (task->state == TASK_QUEUED) {
+            // Nobody has started it, so take it back and run it here
+            Task **link = &pool->queue;
+            while (*link != task) {
+                link = &(*link)->next;
+            }
+            *link = task->next;
+            next = task;
+        } else if (next) {
+            pool->queue = next->next;
+        } else {
+            pthread_cond_wait(&pool->finished, &pool->lock);
+            continue;
+        }
+        run(pool, next);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
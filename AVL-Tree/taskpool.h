@@ -0,0 +1,76 @@
+/**
+ * @file taskpool.h
+ * @author Brian Gillespie
+ *
+ * Prototypes for a small fork-join thread pool. A task is spawned onto
+ * the pool, where an idle worker may pick it up, and the thread that
+ * spawned it later waits for it. A waiting thread never just sleeps
+ * while there is queued work: it runs its own task itself if no worker
+ * has taken it yet, or helps with other queued tasks until it finishes.
+ * This keeps every thread busy during recursive divide-and-conquer work
+ * and means nested waits cannot deadlock.
+ */
+
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+/**
+ * Opaque handle to a pool of worker threads.
+ */
+typedef struct TaskPool TaskPool;
+
+/**
+ * A unit of work. Owned by the caller, usually on its stack, and must
+ * stay valid until task_wait returns for it.
+ */
+typedef struct Task {
+    /** Function to run */
+    void (*fn)(void *arg);
+    /** Argument passed to fn */
+    void *arg;
+    /** Whether the task is queued, running or done. Guarded by the pool */
+    int state;
+    /** Next task in the pool's queue */
+    struct Task *next;
+} Task;
+
+/**
+ * Starts a pool with the given number of worker threads. The thread that
+ * spawns and waits for tasks also runs them, so a pool for n threads of
+ * work needs n - 1 workers.
+ *
+ * @param workers number of worker threads to start
+ *
+ * @return pointer to the new pool, or NULL if it could not be started
+ */
+TaskPool *createTaskPool(int workers);
+
+/**
+ * Stops the worker threads and frees the pool. Every spawned task must
+ * have been waited for.
+ *
+ * @param *pool the pool to free
+ */
+void freeTaskPool(TaskPool *pool);
+
+/**
+ * Queues fn(arg) to run on the pool.
+ *
+ * @param *pool the pool to run the task on
+ * @param *task storage for the task
+ * @param fn the function to run
+ * @param *arg argument passed to fn
+ */
+void task_spawn(TaskPool *pool, Task *task, void (*fn)(void *arg),
+                void *arg);
+
+/**
+ * Returns once the task has finished, running it or other queued tasks
+ * on the calling thread in the meantime.
+ *
+ * @param *pool the pool the task was spawned on
+ * @param *task the task to wait for
+ */
+void task_wait(TaskPool *pool, Task *task);
+
+#endif
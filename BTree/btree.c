@@ -0,0 +1,455 @@
+/**
+ * @file btree.c
+ * @author Brian Gillespie
+ *
+ * Implementation of a B-Tree with integer keys and void pointers for
+ * values. Insertion splits full nodes on the way down and deletion tops
+ * up thin nodes on the way down, so both finish in a single pass from
+ * the root without needing a path stack.
+ *
+ * The position of a key within a node is found by counting the keys that
+ * are smaller than it. Unused key slots hold INT_MAX, which is never
+ * smaller than any key, so the count can be taken over every slot with
+ * vector compares and no branches.
+ */
+
+#include "btree.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Static function prototypes */
+static BTreeNode *newNode(bool leaf);
+static void freeNode(BTreeNode *node);
+static int rank(const BTreeNode *node, int key);
+static bool splitChild(BTreeNode *parent, int index);
+static void mergeChildren(BTreeNode *parent, int index);
+static void borrowFromLeft(BTreeNode *parent, int index);
+static void borrowFromRight(BTreeNode *parent, int index);
+
+/** Documented in btree.h */
+BTree *createBTree() {
+    BTree *tree = malloc(sizeof(BTree));
+    if (tree) {
+        tree->root = NULL;
+        tree->count = 0;
+    }
+    return tree;
+}
+
+/** Documented in btree.h */
+void freeBTree(BTree *tree) {
+    if (tree == NULL) {
+        return;
+    }
+    freeNode(tree->root);
+    free(tree);
+}
+
+/**
+ * Frees a node and all of its subtrees. B-Trees are shallow enough that
+ * recursion depth is not a concern.
+ *
+ * @param *node the root of the subtree to free
+ */
+static void freeNode(BTreeNode *node) {
+    if (node == NULL) {
+        return;
+    }
+    if (!node->leaf) {
+        for (int i = 0; i <= node->count; i++) {
+            freeNode(node->children[i]);
+        }
+    }
+    free(node);
+}
+
+/**
+ * Allocates an empty node. Leaves are allocated without space for
+ * children.
+ *
+ * @param leaf whether the node is a leaf
+ *
+ * @return pointer to the new node, or NULL if allocation fails
+ */
+static BTreeNode *newNode(bool leaf) {
+    size_t children = leaf ? 0 : BTREE_MAX_KEYS + 1;
+    BTreeNode *node = malloc(sizeof(BTreeNode)
+                             + children * sizeof(BTreeNode *));
+    if (node) {
+        for (int i = 0; i < BTREE_KEY_SLOTS; i++) {
+            node->keys[i] = INT_MAX;
+        }
+        node->count = 0;
+        node->leaf = leaf;
+    }
+    return node;
+}
+
+/**
+ * Counts the keys in a node that are smaller than the given key. This is
+ * the index the key has, or would have, in the node, and the index of the
+ * child to descend into if it is not in the node.
+ *
+ * @param *node the node to search
+ * @param key the key to search for
+ *
+ * @return number of keys in the node less than key
+ */
+static int rank(const BTreeNode *node, int key) {
+#if defined(__AVX2__)
+    // Each lane of a true compare is -1, so subtracting counts them
+    __m256i target = _mm256_set1_epi32(key);
+    __m256i total = _mm256_setzero_si256();
+    for (int i = 0; i < BTREE_KEY_SLOTS; i += 8) {
+        __m256i keys = _mm256_loadu_si256((const __m256i *) &node->keys[i]);
+        total = _mm256_sub_epi32(total, _mm256_cmpgt_epi32(target, keys));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(total),
+                                _mm256_extracti128_si256(total, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+#elif defined(__SSE2__)
+    __m128i target = _mm_set1_epi32(key);
+    __m128i total = _mm_setzero_si128();
+    for (int i = 0; i < BTREE_KEY_SLOTS; i += 4) {
+        __m128i keys = _mm_loadu_si128((const __m128i *) &node->keys[i]);
+        total = _mm_sub_epi32(total, _mm_cmpgt_epi32(target, keys));
+    }
+    total = _mm_add_epi32(total,
+                          _mm_shuffle_epi32(total, _MM_SHUFFLE(1, 0, 3, 2)));
+    total = _mm_add_epi32(total,
+                          _mm_shuffle_epi32(total, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(total);
+#else
+    int pos = 0;
+    while (pos < node->count && node->keys[pos] < key) {
+        pos++;
+    }
+    return pos;
+#endif
+}
+
+/** Documented in btree.h */
+bool insert_btree(int key, void *value, BTree *tree) {
+    if (tree == NULL) {
+        return false;
+    }
+    if (tree->root == NULL) {
+        tree->root = newNode(true);
+        if (tree->root == NULL) {
+            return false;
+        }
+    }
+    if (tree->root->count == BTREE_MAX_KEYS) {
+        // Split a full root under a new root; this is how the tree grows
+        BTreeNode *root = newNode(false);
+        if (root == NULL) {
+            return false;
+        }
+        root->children[0] = tree->root;
+        if (!splitChild(root, 0)) {
+            free(root);
+            return false;
+        }
+        tree->root = root;
+    }
+
+    // Every node we step into has room for one more key
+    BTreeNode *node = tree->root;
+    while (true) {
+        int pos = rank(node, key);
+        if (pos < node->count && node->keys[pos] == key) {
+            // update value in the existing key
+            node->values[pos] = value;
+            return true;
+        }
+
+        if (node->leaf) {
+            int moved = node->count - pos;
+            memmove(&node->keys[pos + 1], &node->keys[pos],
+                    moved * sizeof(int));
+            memmove(&node->values[pos + 1], &node->values[pos],
+                    moved * sizeof(void *));
+            node->keys[pos] = key;
+            node->values[pos] = value;
+            node->count++;
+            tree->count++;
+            return true;
+        }
+
+        if (node->children[pos]->count == BTREE_MAX_KEYS) {
+            if (!splitChild(node, pos)) {
+                return false;
+            }
+            // The middle key of the child moved up to position pos
+            if (key == node->keys[pos]) {
+                node->values[pos] = value;
+                return true;
+            }
+            if (key > node->keys[pos]) {
+                pos++;
+            }
+        }
+        node = node->children[pos];
+    }
+}
+
+/**
+ * Splits the full child at index into two nodes, moving its middle key
+ * up into the parent. The parent must not be full.
+ *
+ * @param *parent the parent of the node to split
+ * @param index index of the child to split
+ *
+ * @return true if the child was split, false if allocation failed
+ */
+static bool splitChild(BTreeNode *parent, int index) {
+    BTreeNode *left = parent->children[index];
+    BTreeNode *right = newNode(left->leaf);
+    if (right == NULL) {
+        return false;
+    }
+
+    const int half = BTREE_MIN_DEGREE;
+    right->count = half - 1;
+    memcpy(right->keys, &left->keys[half], (half - 1) * sizeof(int));
+    memcpy(right->values, &left->values[half], (half - 1) * sizeof(void *));
+    if (!left->leaf) {
+        memcpy(right->children, &left->children[half],
+               half * sizeof(BTreeNode *));
+    }
+
+    int middle = left->keys[half - 1];
+    void *middleValue = left->values[half - 1];
+    left->count = half - 1;
+    for (int i = half - 1; i < BTREE_MAX_KEYS; i++) {
+        left->keys[i] = INT_MAX;
+    }
+
+    int moved = parent->count - index;
+    memmove(&parent->keys[index + 1], &parent->keys[index],
+            moved * sizeof(int));
+    memmove(&parent->values[index + 1], &parent->values[index],
+            moved * sizeof(void *));
+    memmove(&parent->children[index + 2], &parent->children[index + 1],
+            moved * sizeof(BTreeNode *));
+    parent->keys[index] = middle;
+    parent->values[index] = middleValue;
+    parent->children[index + 1] = right;
+    parent->count++;
+    return true;
+}
+
+/** Documented in btree.h */
+void *delete_btree(int key, BTree *tree) {
+    if (tree == NULL || tree->root == NULL) {
+        return NULL;
+    }
+
+    void *value = NULL;
+    bool found = false;
+    BTreeNode *node = tree->root;
+
+    /* Every node we step into, other than the root, has at least
+        BTREE_MIN_DEGREE keys, so it can lose one without underflowing. */
+    while (true) {
+        int pos = rank(node, key);
+        bool here = pos < node->count && node->keys[pos] == key;
+        if (here && !found) {
+            value = node->values[pos];
+            found = true;
+        }
+
+        if (node->leaf) {
+            if (here) {
+                int moved = node->count - pos - 1;
+                memmove(&node->keys[pos], &node->keys[pos + 1],
+                        moved * sizeof(int));
+                memmove(&node->values[pos], &node->values[pos + 1],
+                        moved * sizeof(void *));
+                node->count--;
+                node->keys[node->count] = INT_MAX;
+            }
+            break;
+        }
+
+        if (here) {
+            BTreeNode *left = node->children[pos];
+            BTreeNode *right = node->children[pos + 1];
+            if (left->count >= BTREE_MIN_DEGREE) {
+                // Replace the key with its predecessor, then delete that
+                BTreeNode *max = left;
+                while (!max->leaf) {
+                    max = max->children[max->count];
+                }
+                node->keys[pos] = max->keys[max->count - 1];
+                node->values[pos] = max->values[max->count - 1];
+                key = node->keys[pos];
+                node = left;
+            } else if (right->count >= BTREE_MIN_DEGREE) {
+                // Replace the key with its successor, then delete that
+                BTreeNode *min = right;
+                while (!min->leaf) {
+                    min = min->children[0];
+                }
+                node->keys[pos] = min->keys[0];
+                node->values[pos] = min->values[0];
+                key = node->keys[pos];
+                node = right;
+            } else {
+                // Both neighbours are thin, so pull the key down into them
+                mergeChildren(node, pos);
+                node = left;
+            }
+            continue;
+        }
+
+        if (node->children[pos]->count < BTREE_MIN_DEGREE) {
+            if (pos > 0
+                    && node->children[pos - 1]->count >= BTREE_MIN_DEGREE) {
+                borrowFromLeft(node, pos);
+            } else if (pos < node->count
+                    && node->children[pos + 1]->count >= BTREE_MIN_DEGREE) {
+                borrowFromRight(node, pos);
+            } else {
+                if (pos == node->count) {
+                    pos--;
+                }
+                mergeChildren(node, pos);
+            }
+        }
+        node = node->children[pos];
+    }
+
+    // A merge may have emptied the root; the tree shrinks from the top
+    if (tree->root->count == 0) {
+        BTreeNode *root = tree->root;
+        tree->root = root->leaf ? NULL : root->children[0];
+        free(root);
+    }
+    if (found) {
+        tree->count--;
+    }
+    return value;
+}
+
+/**
+ * Merges the child at index, the key at index and the child after it
+ * into a single node, which takes the place of the first child. Both
+ * children must have BTREE_MIN_DEGREE - 1 keys.
+ *
+ * @param *parent the parent of the children to merge
+ * @param index index of the key separating the children
+ */
+static void mergeChildren(BTreeNode *parent, int index) {
+    BTreeNode *left = parent->children[index];
+    BTreeNode *right = parent->children[index + 1];
+
+    left->keys[left->count] = parent->keys[index];
+    left->values[left->count] = parent->values[index];
+    memcpy(&left->keys[left->count + 1], right->keys,
+           right->count * sizeof(int));
+    memcpy(&left->values[left->count + 1], right->values,
+           right->count * sizeof(void *));
+    if (!left->leaf) {
+        memcpy(&left->children[left->count + 1], right->children,
+               (right->count + 1) * sizeof(BTreeNode *));
+    }
+    left->count += 1 + right->count;
+    free(right);
+
+    int moved = parent->count - index - 1;
+    memmove(&parent->keys[index], &parent->keys[index + 1],
+            moved * sizeof(int));
+    memmove(&parent->values[index], &parent->values[index + 1],
+            moved * sizeof(void *));
+    memmove(&parent->children[index + 1], &parent->children[index + 2],
+            moved * sizeof(BTreeNode *));
+    parent->count--;
+    parent->keys[parent->count] = INT_MAX;
+}
+
+/**
+ * Moves a key from the left sibling of the child at index up into the
+ * parent, and the separating key down into the front of the child.
+ *
+ * @param *parent the parent of the child to top up
+ * @param index index of the child to top up
+ */
+static void borrowFromLeft(BTreeNode *parent, int index) {
+    BTreeNode *child = parent->children[index];
+    BTreeNode *left = parent->children[index - 1];
+
+    memmove(&child->keys[1], child->keys, child->count * sizeof(int));
+    memmove(&child->values[1], child->values, child->count * sizeof(void *));
+    if (!child->leaf) {
+        memmove(&child->children[1], child->children,
+                (child->count + 1) * sizeof(BTreeNode *));
+        child->children[0] = left->children[left->count];
+    }
+    child->keys[0] = parent->keys[index - 1];
+    child->values[0] = parent->values[index - 1];
+    child->count++;
+
+    left->count--;
+    parent->keys[index - 1] = left->keys[left->count];
+    parent->values[index - 1] = left->values[left->count];
+    left->keys[left->count] = INT_MAX;
+}
+
+/**
+ * Moves a key from the right sibling of the child at index up into the
+ * parent, and the separating key down onto the end of the child.
+ *
+ * @param *parent the parent of the child to top up
+ * @param index index of the child to top up
+ */
+static void borrowFromRight(BTreeNode *parent, int index) {
+    BTreeNode *child = parent->children[index];
+    BTreeNode *right = parent->children[index + 1];
+
+    child->keys[child->count] = parent->keys[index];
+    child->values[child->count] = parent->values[index];
+    if (!child->leaf) {
+        child->children[child->count + 1] = right->children[0];
+    }
+    child->count++;
+
+    parent->keys[index] = right->keys[0];
+    parent->values[index] = right->values[0];
+    right->count--;
+    memmove(right->keys, &right->keys[1], right->count * sizeof(int));
+    memmove(right->values, &right->values[1], right->count * sizeof(void *));
+    if (!right->leaf) {
+        memmove(right->children, &right->children[1],
+                (right->count + 1) * sizeof(BTreeNode *));
+    }
+    right->keys[right->count] = INT_MAX;
+}
+
+/** Documented in btree.h */
+void *lookup_btree(int key, BTree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    const BTreeNode *node = tree->root;
+    while (node) {
+        int pos = rank(node, key);
+        if (pos < node->count && node->keys[pos] == key) {
+            return node->values[pos];
+        }
+        node = node->leaf ? NULL : node->children[pos];
+    }
+    return NULL;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file btree.h
+ * @author Brian Gillespie
+ *
+ * Prototypes and structs for public B-Tree functions. The interface
+ * mirrors the AVL tree in ../AVL-Tree/avl.h, but each node holds up to
+ * BTREE_MAX_KEYS keys, so a search touches far fewer nodes on the way
+ * down. Keys within a node are searched with SIMD compares when the
+ * compiler targets SSE2 or AVX2.
+ */
+
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Minimum degree of the tree. Every node other than the root holds
+ * between BTREE_MIN_DEGREE - 1 and 2 * BTREE_MIN_DEGREE - 1 keys.
+ */
+#define BTREE_MIN_DEGREE 16
+
+/** Maximum number of keys in a node */
+#define BTREE_MAX_KEYS (2 * BTREE_MIN_DEGREE - 1)
+
+/**
+ * Number of key slots in a node. One more than BTREE_MAX_KEYS so the key
+ * array is a whole number of vector registers. Unused slots hold INT_MAX.
+ */
+#define BTREE_KEY_SLOTS (BTREE_MAX_KEYS + 1)
+
+/**
+ * Defines a node in a B-Tree. Internal nodes are allocated with room for
+ * BTREE_MAX_KEYS + 1 children, and leaves with none.
+ */
+typedef struct BTreeNode {
+    /** Keys in ascending order, padded with INT_MAX */
+    int keys[BTREE_KEY_SLOTS];
+    /** Values matching the keys */
+    void *values[BTREE_MAX_KEYS];
+    /** Number of keys in this node */
+    int count;
+    /** Whether this node is a leaf */
+    bool leaf;
+    /** Subtrees between the keys. Not allocated for leaves */
+    struct BTreeNode *children[];
+} BTreeNode;
+
+/**
+ * Struct to hold a B-Tree, so that calling code can keep a constant
+ * pointer to the tree while the root changes.
+ */
+typedef struct BTree {
+    /** Root node of the tree, or NULL if the tree is empty */
+    BTreeNode *root;
+    /** Number of keys in the tree */
+    size_t count;
+} BTree;
+
+/**
+ * Creates a new, empty tree
+ *
+ * @return pointer to a new tree, or NULL if allocation fails
+ */
+BTree *createBTree();
+
+/**
+ * Frees all memory associated with the given tree
+ *
+ * @param *tree the tree to free
+ */
+void freeBTree(BTree *tree);
+
+/**
+ * Inserts a new key into the tree, or updates the value of an existing
+ * key.
+ *
+ * @param key the key to insert
+ * @param *value pointer to the value to store
+ * @param *tree pointer to the tree to insert into
+ *
+ * @return true if the insertion is successful, false if a node could not
+ * be allocated
+ */
+bool insert_btree(int key, void *value, BTree *tree);
+
+/**
+ * Removes a key from the tree and returns its value.
+ *
+ * @param key the key to remove
+ * @param *tree the tree to delete from
+ *
+ * @return pointer to the value of the deleted key, or NULL if the key
+ * was not found.
+ */
+void *delete_btree(int key, BTree *tree);
+
+/**
+ * Locates the key in the tree and returns a pointer to the value. The
+ * key is not removed.
+ *
+ * @param key the key to search for
+ * @param *tree the tree to search
+ *
+ * @return pointer to the value stored at the key, or NULL if the key was
+ * not found.
+ */
+void *lookup_btree(int key, BTree *tree);
+
+#endif
@@ -0,0 +1,51 @@
+/**
+ * @file driver.c
+ * @author Brian Gillespie
+ *
+ * Sample driver program for the B-Tree module. Demonstrates the
+ * functionality and use of the structure.
+ */
+
+#include "btree.h"
+#include <stdio.h>
+
+/**
+ * Prints the keys of each node on a line, indented by depth.
+ *
+ * @param *node the root of the subtree to print
+ * @param depth depth of the node in the tree
+ */
+static void print_nodes(BTreeNode *node, int depth) {
+    if (node == NULL) {
+        return;
+    }
+    printf("%*s", depth * 4, "");
+    for (int i = 0; i < node->count; i++) {
+        printf("%d ", node->keys[i]);
+    }
+    putchar('\n');
+    if (!node->leaf) {
+        for (int i = 0; i <= node->count; i++) {
+            print_nodes(node->children[i], depth + 1);
+        }
+    }
+}
+
+int main() {
+    printf("B-Tree Driver\n");
+
+    BTree *tree = createBTree();
+    // Add 100 nodes in key order, then remove every third one.
+    for (int i = 0; i < 100; i++) {
+        insert_btree(i, NULL, tree);
+    }
+    print_nodes(tree->root, 0);
+    printf("======================================\n");
+    for (int i = 0; i < 100; i += 3) {
+        delete_btree(i, tree);
+    }
+    print_nodes(tree->root, 0);
+    printf("%zu keys\n", tree->count);
+    freeBTree(tree);
+    return 0;
+}
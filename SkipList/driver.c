@@ -0,0 +1,77 @@
+/**
+ * @file driver.c
+ * @author Brian Gillespie
+ *
+ * Sample driver program for the skip list module. Demonstrates the
+ * functionality and use of the structure, including several threads
+ * changing the list at once.
+ */
+
+#include "skiplist.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+/** Number of threads in the concurrent part of the demonstration */
+#define THREADS 4
+
+/** Keys each thread inserts */
+#define KEYS_PER_THREAD 10000
+
+/**
+ * Prints one key of a range scan.
+ */
+static bool print_key(int key, void *value, void *ctx) {
+    (void) value;
+    (void) ctx;
+    printf("%d ", key);
+    return true;
+}
+
+/**
+ * Inserts a block of keys belonging to one thread, then deletes every
+ * other one of them.
+ *
+ * @param *arg the list to change
+ */
+static void *worker(void *arg) {
+    static atomic_int nextBlock;
+    SkipList *list = arg;
+    int base = atomic_fetch_add(&nextBlock, 1) * KEYS_PER_THREAD;
+    for (int i = 0; i < KEYS_PER_THREAD; i++) {
+        insert_skiplist(base + i, NULL, list);
+    }
+    for (int i = 0; i < KEYS_PER_THREAD; i += 2) {
+        delete_skiplist(base + i, list);
+    }
+    return NULL;
+}
+
+int main() {
+    printf("Skip List Driver\n");
+
+    SkipList *list = createSkipList();
+    // Add 100 keys in random order, then remove every third one.
+    for (int i = 0; i < 100; i++) {
+        insert_skiplist(i * 37 % 100, NULL, list);
+    }
+    for (int i = 0; i < 100; i += 3) {
+        delete_skiplist(i, list);
+    }
+    skiplist_range(list, 0, 99, print_key, NULL);
+    printf("\n%zu keys\n", skiplist_count(list));
+    freeSkipList(list);
+
+    printf("======================================\n");
+    list = createSkipList();
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, worker, list);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("%zu keys after %d threads\n", skiplist_count(list), THREADS);
+    freeSkipList(list);
+    return 0;
+}
@@ -0,0 +1,578 @@
+/**
+ * @file skiplist.c
+ * @author Brian Gillespie
+ *
+ * Implementation of the lock-free skip list, after the algorithm of
+ * Herlihy and Shavit, "The Art of Multiprocessor Programming", ch. 14.
+ *
+ * The lowest bit of each link marks the node it belongs to as deleted at
+ * that level. A marked link never changes again, so nothing can be linked
+ * in after a deleted node. A delete marks every level of the node from
+ * the top down; the level 0 mark is what removes the key. Searches that
+ * meet a marked node unlink it with a compare-and-swap on its
+ * predecessor.
+ *
+ * Each node counts the levels it is still linked at, or will be linked
+ * at by its inserter, and is retired by whichever thread drops that count
+ * to zero. A search never steps down from a marked node, so no link it
+ * follows leads to a node that has already been retired.
+ *
+ * Retired nodes wait on one of three lists, one per epoch. The global
+ * epoch only advances when every thread inside an operation has seen the
+ * current one, so once it has advanced twice past the epoch a node was
+ * retired in, no operation can still hold that node.
+ */
+
+#include "skiplist.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Most levels a node can have. Enough for 4^16 keys at p = 1/4 */
+#define MAX_LEVEL 16
+
+/** Retirements a thread makes between attempts to advance the epoch */
+#define RETIRE_BATCH 64
+
+/** Size of a cache line, so epoch slots do not share one */
+#define CACHE_LINE 64
+
+/** Epoch slot value of a slot no thread is using */
+#define IDLE UINT64_MAX
+
+/**
+ * A key and its links to the next node at each of its levels.
+ */
+typedef struct SkipNode {
+    /** The key of the node */
+    int key;
+    /** Number of levels the node has */
+    int levels;
+    /** The value of the node */
+    _Atomic(void *) value;
+    /** Levels the node is linked at or will be linked at */
+    atomic_int links;
+    /** Next node waiting to be freed, once this one is retired */
+    struct SkipNode *retired;
+    /** Link to the next node at each level, with the mark in bit 0 */
+    _Atomic(uintptr_t) next[];
+} SkipNode;
+
+/**
+ * Announcement of the epoch a thread entered an operation in.
+ */
+typedef struct EpochSlot {
+    /** Epoch seen by the thread using the slot, or IDLE */
+    _Alignas(CACHE_LINE) _Atomic(uint64_t) epoch;
+    /** Number of keys added less keys removed by threads using the slot */
+    atomic_long delta;
+} EpochSlot;
+
+/** Defined in skiplist.h */
+struct SkipList {
+    /** Sentinel before the first node, with every level */
+    SkipNode *head;
+    /** Global epoch */
+    _Atomic(uint64_t) epoch;
+    /** Nodes retired in each epoch, indexed by epoch modulo 3 */
+    _Atomic(SkipNode *) limbo[3];
+    /** One slot for each thread inside an operation */
+    EpochSlot slots[SKIPLIST_THREADS];
+};
+
+/* Static function prototypes */
+static EpochSlot *enter(SkipList *list);
+static void leave(EpochSlot *slot);
+static void retire(SkipList *list, SkipNode *node);
+static void advance(SkipList *list, uint64_t now);
+static void freeChain(SkipNode *node);
+static void release_levels(SkipList *list, SkipNode *node, int count);
+static int random_level(void);
+static bool find(SkipList *list, int key, SkipNode **preds,
+                 SkipNode **succs);
+
+/** Slot each thread tries first, spread out so threads rarely collide */
+static _Thread_local unsigned slotHint = UINT_MAX;
+
+/** Source of slot hints for new threads */
+static atomic_uint nextHint;
+
+/** Retirements made by this thread, to pace epoch advances */
+static _Thread_local unsigned retireCount;
+
+/** State of each thread's xorshift generator for node levels */
+static _Thread_local uint64_t levelState;
+
+/**
+ * Returns the node a link points to, without its mark.
+ */
+static inline SkipNode *target(uintptr_t link) {
+    return (SkipNode *) (link & ~(uintptr_t) 1);
+}
+
+/**
+ * Returns true if a link belongs to a node deleted at that level.
+ */
+static inline bool marked(uintptr_t link) {
+    return link & 1;
+}
+
+/** Documented in skiplist.h */
+SkipList *createSkipList(void) {
+    SkipList *list = aligned_alloc(CACHE_LINE, sizeof(SkipList));
+    if (list == NULL) {
+        return NULL;
+    }
+    list->head = malloc(sizeof(SkipNode) +
+                        MAX_LEVEL * sizeof(_Atomic(uintptr_t)));
+    if (list->head == NULL) {
+        free(list);
+        return NULL;
+    }
+    list->head->key = INT_MIN;
+    list->head->levels = MAX_LEVEL;
+    atomic_init(&list->head->value, NULL);
+    atomic_init(&list->head->links, MAX_LEVEL);
+    list->head->retired = NULL;
+    for (int i = 0; i < MAX_LEVEL; i++) {
+        atomic_init(&list->head->next[i], 0);
+    }
+    atomic_init(&list->epoch, 0);
+    for (int i = 0; i < 3; i++) {
+        atomic_init(&list->limbo[i], NULL);
+    }
+    for (int i = 0; i < SKIPLIST_THREADS; i++) {
+        atomic_init(&list->slots[i].epoch, IDLE);
+        atomic_init(&list->slots[i].delta, 0);
+    }
+    return list;
+}
+
+/** Documented in skiplist.h */
+void freeSkipList(SkipList *list) {
+    if (list == NULL) {
+        return;
+    }
+    /* Unlink nodes that were deleted but are still linked at some level,
+        from the top down, so that each is freed once it is linked at none */
+    for (int level = MAX_LEVEL - 1; level >= 0; level--) {
+        SkipNode *pred = list->head;
+        SkipNode *curr = target(pred->next[level]);
+        while (curr) {
+            uintptr_t next = curr->next[level];
+            if (marked(next)) {
+                pred->next[level] = next & ~(uintptr_t) 1;
+                if (--curr->links == 0) {
+                    free(curr);
+                }
+            } else {
+                pred = curr;
+            }
+            curr = target(next);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        freeChain(list->limbo[i]);
+    }
+    SkipNode *node = list->head;
+    while (node) {
+        SkipNode *next = target(node->next[0]);
+        free(node);
+        node = next;
+    }
+    free(list);
+}
+
+/**
+ * Frees a chain of retired nodes.
+ *
+ * @param *node the first node of the chain, or NULL
+ */
+static void freeChain(SkipNode *node) {
+    while (node) {
+        SkipNode *next = node->retired;
+        free(node);
+        node = next;
+    }
+}
+
+/** Documented in skiplist.h */
+bool insert_skiplist(int key, void *value, SkipList *list) {
+    if (list == NULL) {
+        return false;
+    }
+    SkipNode *preds[MAX_LEVEL];
+    SkipNode *succs[MAX_LEVEL];
+    SkipNode *node = NULL;
+    EpochSlot *slot = enter(list);
+
+    for (;;) {
+        if (find(list, key, preds, succs)) {
+            // update value in the existing node
+            atomic_store_explicit(&succs[0]->value, value,
+                                  memory_order_release);
+            free(node);
+            leave(slot);
+            return true;
+        }
+        if (node == NULL) {
+            int levels = random_level();
+            node = malloc(sizeof(SkipNode) +
+                          levels * sizeof(_Atomic(uintptr_t)));
+            if (node == NULL) {
+                leave(slot);
+                return false;
+            }
+            node->key = key;
+            node->levels = levels;
+            atomic_init(&node->value, value);
+            atomic_init(&node->links, levels);
+            node->retired = NULL;
+        }
+        for (int i = 0; i < node->levels; i++) {
+            atomic_init(&node->next[i], (uintptr_t) succs[i]);
+        }
+        // Linking level 0 is what adds the key
+        uintptr_t expected = (uintptr_t) succs[0];
+        if (atomic_compare_exchange_strong_explicit(
+                &preds[0]->next[0], &expected, (uintptr_t) node,
+                memory_order_release, memory_order_relaxed)) {
+            break;
+        }
+    }
+    atomic_fetch_add_explicit(&slot->delta, 1, memory_order_relaxed);
+
+    // Link the upper levels, unless a delete gets to the node first
+    for (int level = 1; level < node->levels; level++) {
+        for (;;) {
+            uintptr_t own = atomic_load_explicit(&node->next[level],
+                                                 memory_order_acquire);
+            if (marked(own)) {
+                release_levels(list, node, node->levels - level);
+                level = node->levels;
+                break;
+            }
+            if (target(own) != succs[level] &&
+                !atomic_compare_exchange_strong_explicit(
+                    &node->next[level], &own, (uintptr_t) succs[level],
+                    memory_order_release, memory_order_relaxed)) {
+                continue;
+            }
+            uintptr_t expected = (uintptr_t) succs[level];
+            if (atomic_compare_exchange_strong_explicit(
+                    &preds[level]->next[level], &expected, (uintptr_t) node,
+                    memory_order_release, memory_order_relaxed)) {
+                break;
+            }
+            find(list, key, preds, succs);
+        }
+    }
+
+    /* A delete that ran while the levels were being linked may have
+        missed the ones linked after it, so unlink them now */
+    if (marked(atomic_load_explicit(&node->next[0], memory_order_acquire))) {
+        find(list, key, NULL, NULL);
+    }
+    leave(slot);
+    return true;
+}
+
+/** Documented in skiplist.h */
+void *delete_skiplist(int key, SkipList *list) {
+    if (list == NULL) {
+        return NULL;
+    }
+    SkipNode *succs[MAX_LEVEL];
+    EpochSlot *slot = enter(list);
+    if (!find(list, key, NULL, succs)) {
+        leave(slot);
+        return NULL;
+    }
+
+    SkipNode *node = succs[0];
+    for (int level = node->levels - 1; level > 0; level--) {
+        uintptr_t link = atomic_load_explicit(&node->next[level],
+                                              memory_order_relaxed);
+        while (!marked(link) &&
+               !atomic_compare_exchange_weak_explicit(
+                   &node->next[level], &link, link | 1,
+                   memory_order_release, memory_order_relaxed)) {
+        }
+    }
+    // Whoever marks level 0 removes the key
+    uintptr_t link = atomic_load_explicit(&node->next[0],
+                                          memory_order_relaxed);
+    do {
+        if (marked(link)) {
+            leave(slot);
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+                 &node->next[0], &link, link | 1,
+                 memory_order_acq_rel, memory_order_relaxed));
+    atomic_fetch_sub_explicit(&slot->delta, 1, memory_order_relaxed);
+
+    void *value = atomic_load_explicit(&node->value, memory_order_acquire);
+    find(list, key, NULL, NULL);
+    leave(slot);
+    return value;
+}
+
+/** Documented in skiplist.h */
+void *lookup_skiplist(int key, SkipList *list) {
+    if (list == NULL) {
+        return NULL;
+    }
+    EpochSlot *slot = enter(list);
+    void *value = NULL;
+
+retry:;
+    /* Marked nodes are stepped over rather than unlinked, so lookups
+        never write to the list */
+    SkipNode *pred = list->head;
+    for (int level = MAX_LEVEL - 1; level >= 0; level--) {
+        uintptr_t link = atomic_load_explicit(&pred->next[level],
+                                              memory_order_acquire);
+        if (marked(link)) {
+            goto retry;
+        }
+        SkipNode *curr = target(link);
+        while (curr) {
+            uintptr_t next = atomic_load_explicit(&curr->next[level],
+                                                  memory_order_acquire);
+            if (!marked(next)) {
+                if (curr->key == key) {
+                    // Unmarked at any level means not yet deleted
+                    value = atomic_load_explicit(&curr->value,
+                                                 memory_order_acquire);
+                    leave(slot);
+                    return value;
+                }
+                if (curr->key > key) {
+                    break;
+                }
+                pred = curr;
+            }
+            curr = target(next);
+        }
+    }
+    leave(slot);
+    return value;
+}
+
+/** Documented in skiplist.h */
+size_t skiplist_count(SkipList *list) {
+    if (list == NULL) {
+        return 0;
+    }
+    long count = 0;
+    for (int i = 0; i < SKIPLIST_THREADS; i++) {
+        count += atomic_load_explicit(&list->slots[i].delta,
+                                      memory_order_relaxed);
+    }
+    return count > 0 ? (size_t) count : 0;
+}
+
+/** Documented in skiplist.h */
+size_t skiplist_range(SkipList *list, int lo, int hi, SkipVisitor fn,
+                      void *ctx) {
+    if (list == NULL || fn == NULL || lo > hi) {
+        return 0;
+    }
+    SkipNode *succs[MAX_LEVEL];
+    size_t visited = 0;
+    EpochSlot *slot = enter(list);
+    find(list, lo, NULL, succs);
+
+    SkipNode *node = succs[0];
+    while (node && node->key <= hi) {
+        uintptr_t next = atomic_load_explicit(&node->next[0],
+                                              memory_order_acquire);
+        if (!marked(next)) {
+            visited++;
+            if (!fn(node->key, atomic_load_explicit(&node->value,
+                                                    memory_order_acquire),
+                    ctx)) {
+                break;
+            }
+        }
+        node = target(next);
+    }
+    leave(slot);
+    return visited;
+}
+
+/**
+ * Searches for a key, unlinking every marked node met on the way. Fills
+ * in, for each level, the last node with a smaller key and the node after
+ * it, both of which were linked and unmarked when they were read.
+ *
+ * @param *list the list to search
+ * @param key the key to search for
+ * @param **preds set to the predecessor at each level, if not NULL
+ * @param **succs set to the successor at each level, if not NULL
+ *
+ * @return true if the successor at level 0 holds the key
+ */
+static bool find(SkipList *list, int key, SkipNode **preds,
+                 SkipNode **succs) {
+    SkipNode *curr;
+retry:
+    curr = NULL;
+    SkipNode *pred = list->head;
+    for (int level = MAX_LEVEL - 1; level >= 0; level--) {
+        uintptr_t link = atomic_load_explicit(&pred->next[level],
+                                              memory_order_acquire);
+        // A deleted predecessor may lead to nodes that have been retired
+        if (marked(link)) {
+            goto retry;
+        }
+        curr = target(link);
+        while (curr) {
+            uintptr_t next = atomic_load_explicit(&curr->next[level],
+                                                  memory_order_acquire);
+            if (marked(next)) {
+                uintptr_t expected = (uintptr_t) curr;
+                if (!atomic_compare_exchange_strong_explicit(
+                        &pred->next[level], &expected, next & ~(uintptr_t) 1,
+                        memory_order_acq_rel, memory_order_relaxed)) {
+                    goto retry;
+                }
+                release_levels(list, curr, 1);
+                curr = target(next);
+            } else if (curr->key < key) {
+                pred = curr;
+                curr = target(next);
+            } else {
+                break;
+            }
+        }
+        if (preds) {
+            preds[level] = pred;
+        }
+        if (succs) {
+            succs[level] = curr;
+        }
+    }
+    return curr && curr->key == key;
+}
+
+/**
+ * Drops levels from the count of levels a node is linked at, and retires
+ * the node once it is linked at none.
+ *
+ * @param *list the list the node belonged to
+ * @param *node the node that was unlinked
+ * @param count number of levels it was unlinked from, or will now never
+ *      be linked at
+ */
+static void release_levels(SkipList *list, SkipNode *node, int count) {
+    if (atomic_fetch_sub_explicit(&node->links, count,
+                                  memory_order_acq_rel) == count) {
+        retire(list, node);
+    }
+}
+
+/**
+ * Draws the number of levels for a new node, each level past the first
+ * with probability 1/4.
+ */
+static int random_level(void) {
+    if (levelState == 0) {
+        levelState = ((uintptr_t) &levelState * UINT64_C(0x9E3779B97F4A7C15))
+                     | 1;
+    }
+    levelState ^= levelState << 13;
+    levelState ^= levelState >> 7;
+    levelState ^= levelState << 17;
+    uint64_t bits = levelState;
+    int level = 1;
+    while (level < MAX_LEVEL && (bits & 3) == 0) {
+        level++;
+        bits >>= 2;
+    }
+    return level;
+}
+
+/**
+ * Announces that the calling thread is inside an operation, by claiming
+ * a free epoch slot and recording the current epoch in it.
+ *
+ * @param *list the list being operated on
+ *
+ * @return the slot claimed, to be passed to leave
+ */
+static EpochSlot *enter(SkipList *list) {
+    if (slotHint == UINT_MAX) {
+        slotHint = atomic_fetch_add_explicit(&nextHint, 1,
+                                             memory_order_relaxed);
+    }
+    for (unsigned i = slotHint;; i++) {
+        EpochSlot *slot = &list->slots[i % SKIPLIST_THREADS];
+        uint64_t idle = IDLE;
+        if (atomic_load_explicit(&slot->epoch, memory_order_relaxed) == IDLE &&
+            atomic_compare_exchange_strong(&slot->epoch, &idle,
+                                           atomic_load(&list->epoch))) {
+            slotHint = i % SKIPLIST_THREADS;
+            // The announcement must be visible before any node is read
+            atomic_thread_fence(memory_order_seq_cst);
+            return slot;
+        }
+    }
+}
+
+/**
+ * Announces that the calling thread has finished its operation.
+ *
+ * @param *slot the slot returned by enter
+ */
+static void leave(EpochSlot *slot) {
+    atomic_store_explicit(&slot->epoch, IDLE, memory_order_release);
+}
+
+/**
+ * Queues a node that is no longer linked anywhere to be freed, and now
+ * and then tries to advance the epoch. Must be called inside an
+ * operation, so the epoch read here cannot be older than any other
+ * running thread's.
+ *
+ * @param *list the list the node belonged to
+ * @param *node the node to free
+ */
+static void retire(SkipList *list, SkipNode *node) {
+    uint64_t now = atomic_load(&list->epoch);
+    _Atomic(SkipNode *) *limbo = &list->limbo[now % 3];
+    node->retired = atomic_load_explicit(limbo, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(limbo, &node->retired,
+                                                  node, memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+    if (++retireCount % RETIRE_BATCH == 0) {
+        advance(list, now);
+    }
+}
+
+/**
+ * Moves the global epoch on if every thread inside an operation has seen
+ * the current one, then frees the nodes retired two epochs ago. Called
+ * inside an operation, which keeps the epoch from moving again until the
+ * nodes are taken off their list.
+ *
+ * @param *list the list whose epoch to advance
+ * @param now the epoch the caller saw
+ */
+static void advance(SkipList *list, uint64_t now) {
+    for (int i = 0; i < SKIPLIST_THREADS; i++) {
+        uint64_t seen = atomic_load(&list->slots[i].epoch);
+        if (seen != IDLE && seen != now) {
+            return;
+        }
+    }
+    if (!atomic_compare_exchange_strong(&list->epoch, &now, now + 1)) {
+        return;
+    }
+    freeChain(atomic_exchange_explicit(&list->limbo[(now + 2) % 3], NULL,
+                                       memory_order_acquire));
+}
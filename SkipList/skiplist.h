@@ -0,0 +1,121 @@
+/**
+ * @file skiplist.h
+ * @author Brian Gillespie
+ *
+ * Prototypes for a lock-free ordered map built on a skip list. Every
+ * operation works with atomic compare-and-swap on the links between
+ * nodes instead of a lock, so writers on different parts of the list
+ * never wait for each other and a stalled thread never blocks the rest.
+ * It offers the same core operations as the concurrent AVL tree in avl.h
+ * and can stand in for it where writes dominate.
+ *
+ * A deleted node is freed once no operation that might still be looking
+ * at it is running, which is tracked with a global epoch that threads
+ * announce on entering an operation. Up to SKIPLIST_THREADS threads can
+ * be inside operations on one list at once; more simply wait their turn.
+ */
+
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Most threads that can be inside operations on one list at once */
+#define SKIPLIST_THREADS 128
+
+/**
+ * Opaque handle to a skip list.
+ */
+typedef struct SkipList SkipList;
+
+/**
+ * Function called for each key visited by skiplist_range.
+ *
+ * @param key the key of the node
+ * @param *value the value of the node
+ * @param *ctx context pointer passed to skiplist_range
+ *
+ * @return true to continue the scan, false to stop it
+ */
+typedef bool (*SkipVisitor)(int key, void *value, void *ctx);
+
+/**
+ * Creates a new, empty skip list.
+ *
+ * @return pointer to a new list, or NULL if allocation fails
+ */
+SkipList *createSkipList(void);
+
+/**
+ * Frees all memory associated with the given list. No other thread may
+ * be using it. The values are not freed.
+ *
+ * @param *list the list to free
+ */
+void freeSkipList(SkipList *list);
+
+/**
+ * Inserts a key into the list, or updates its value if it is already
+ * present.
+ *
+ * @param key the key to insert
+ * @param *value pointer to the value to store
+ * @param *list pointer to the list to insert into
+ *
+ * @return true if the insertion is successful, false if a new node could
+ * not be allocated
+ */
+bool insert_skiplist(int key, void *value, SkipList *list);
+
+/**
+ * Removes a key from the list and returns its value.
+ *
+ * @param key the key to remove
+ * @param *list the list to delete from
+ *
+ * @return pointer to the value of the deleted key, or NULL if the key
+ * was not found
+ */
+void *delete_skiplist(int key, SkipList *list);
+
+/**
+ * Locates the key in the list and returns a pointer to the value.
+ *
+ * @param key the key to search for
+ * @param *list the list to search
+ *
+ * @return pointer to the value stored at the key, or NULL if the key was
+ * not found
+ */
+void *lookup_skiplist(int key, SkipList *list);
+
+/**
+ * Counts the keys in the list. While other threads are changing the list
+ * the result is only approximate.
+ *
+ * @param *list the list to count
+ *
+ * @return number of keys in the list
+ */
+size_t skiplist_count(SkipList *list);
+
+/**
+ * Calls fn for every key in the range [lo, hi], in ascending key order.
+ * Keys inserted or deleted by other threads during the scan may or may
+ * not be seen. Deleted nodes cannot be freed while a scan runs, so long
+ * scans should be kept rare.
+ *
+ * @param *list the list to scan
+ * @param lo smallest key in the range
+ * @param hi largest key in the range
+ * @param fn the function to call for each key; returning false stops
+ *      the scan
+ * @param *ctx context pointer passed through to fn
+ *
+ * @return number of keys fn was called for
+ */
+size_t skiplist_range(SkipList *list, int lo, int hi, SkipVisitor fn,
+                      void *ctx);
+
+#endif
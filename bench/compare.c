@@ -0,0 +1,157 @@
+/**
+ * @file compare.c
+ * @author Brian Gillespie
+ *
+ * Compares the AVL tree variants against the B-Tree on the same random
+ * workload: insert N keys, look up M keys (about half of them present),
+ * then delete every key. Prints the time per operation for each phase.
+ *
+ * Usage: compare [N] [M]
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "avl.h"
+#include "btree.h"
+#include "compact.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/** Default number of keys to insert */
+#define DEFAULT_KEYS 1000000
+
+/** Default number of lookups to run */
+#define DEFAULT_LOOKUPS 2000000
+
+/**
+ * Adapts one container to a common set of operations, so every
+ * container runs the exact same loop.
+ */
+typedef struct Container {
+    /** Name to print */
+    const char *name;
+    /** Creates an empty container */
+    void *(*create)(void);
+    /** Inserts a key */
+    bool (*insert)(int key, void *value, void *c);
+    /** Looks up a key */
+    void *(*lookup)(int key, void *c);
+    /** Deletes a key */
+    void *(*delete)(int key, void *c);
+    /** Frees the container */
+    void (*destroy)(void *c);
+} Container;
+
+static void *avlCreate(void) { return createAVLTree(); }
+static void *arenaCreate(void) { return createAVLTreeWithArena(0); }
+static bool avlInsert(int k, void *v, void *c) { return insert_avl(k, v, c); }
+static void *avlLookup(int k, void *c) { return lookup_avl(k, c); }
+static void *avlDelete(int k, void *c) { return delete_avl(k, c); }
+static void avlDestroy(void *c) { freeTree(c); }
+
+static void *compactCreate(void) { return createCompactAVLTree(); }
+static bool compactInsert(int k, void *v, void *c) {
+    return insert_compact(k, v, c);
+}
+static void *compactLookup(int k, void *c) { return lookup_compact(k, c); }
+static void *compactDelete(int k, void *c) { return delete_compact(k, c); }
+static void compactDestroy(void *c) { freeCompactTree(c); }
+
+static void *btreeCreate(void) { return createBTree(); }
+static bool btreeInsert(int k, void *v, void *c) {
+    return insert_btree(k, v, c);
+}
+static void *btreeLookup(int k, void *c) { return lookup_btree(k, c); }
+static void *btreeDelete(int k, void *c) { return delete_btree(k, c); }
+static void btreeDestroy(void *c) { freeBTree(c); }
+
+/** Containers to compare */
+static const Container containers[] = {
+    { "avl", avlCreate, avlInsert, avlLookup, avlDelete, avlDestroy },
+    { "avl-arena", arenaCreate, avlInsert, avlLookup, avlDelete,
+      avlDestroy },
+    { "avl-compact", compactCreate, compactInsert, compactLookup,
+      compactDelete, compactDestroy },
+    { "btree", btreeCreate, btreeInsert, btreeLookup, btreeDelete,
+      btreeDestroy },
+};
+
+/**
+ * Reads a monotonic clock.
+ *
+ * @return the current time in seconds
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Small xorshift generator, so every container sees the same keys.
+ *
+ * @param *state generator state, must not be 0
+ *
+ * @return the next pseudo-random number
+ */
+static uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+int main(int argc, char *argv[]) {
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_KEYS;
+    size_t m = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_LOOKUPS;
+
+    int *keys = malloc(n * sizeof(int));
+    int *probes = malloc(m * sizeof(int));
+    if (keys == NULL || probes == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = (int) (next_random(&state) % (2 * n));
+    }
+    for (size_t i = 0; i < m; i++) {
+        probes[i] = (int) (next_random(&state) % (2 * n));
+    }
+
+    printf("%zu keys, %zu lookups (ns/op)\n", n, m);
+    printf("%-12s %10s %10s %10s\n", "container", "insert", "lookup",
+           "delete");
+    for (size_t c = 0; c < sizeof(containers) / sizeof(containers[0]); c++) {
+        const Container *impl = &containers[c];
+        void *tree = impl->create();
+        uintptr_t found = 0;
+
+        double start = now();
+        for (size_t i = 0; i < n; i++) {
+            impl->insert(keys[i], &keys[i], tree);
+        }
+        double inserted = now();
+        for (size_t i = 0; i < m; i++) {
+            found += (uintptr_t) impl->lookup(probes[i], tree) != 0;
+        }
+        double looked = now();
+        for (size_t i = 0; i < n; i++) {
+            impl->delete(keys[i], tree);
+        }
+        double deleted = now();
+        impl->destroy(tree);
+
+        printf("%-12s %10.1f %10.1f %10.1f   (%lu hits)\n", impl->name,
+               (inserted - start) * 1e9 / n, (looked - inserted) * 1e9 / m,
+               (deleted - looked) * 1e9 / n, (unsigned long) found);
+    }
+
+    free(keys);
+    free(probes);
+    return 0;
+}
@@ -0,0 +1,274 @@
+/**
+ * @file scale.c
+ * @author Brian Gillespie
+ *
+ * Measures how the concurrent containers scale with the number of
+ * threads. Each container is loaded with N keys, then T threads share M
+ * operations on it: a fraction of lookups, and otherwise an even split
+ * of inserts and deletes on uniformly random keys. T doubles from 1 for
+ * as long as it stays within the maximum. Prints the throughput of every
+ * container at every thread count, so the locked AVL tree can be compared
+ * with the lock-free skip list.
+ *
+ * Usage: scale [-n keys] [-m ops] [-r read fraction] [-t max threads]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "avl.h"
+#include "skiplist.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Default number of keys to load */
+#define DEFAULT_KEYS 1000000
+
+/** Default number of operations shared by the threads */
+#define DEFAULT_OPS 4000000
+
+/** Default fraction of lookups */
+#define DEFAULT_READS 0.5
+
+/** Default largest thread count */
+#define DEFAULT_THREADS 64
+
+/**
+ * Adapts one container to a common set of operations, so every
+ * container runs the exact same loop.
+ */
+typedef struct Container {
+    /** Name to print */
+    const char *name;
+    /** Creates an empty container that threads can share */
+    void *(*create)(void);
+    /** Inserts a key */
+    bool (*insert)(int key, void *value, void *c);
+    /** Looks up a key */
+    void *(*lookup)(int key, void *c);
+    /** Deletes a key */
+    void *(*delete)(int key, void *c);
+    /** Frees the container */
+    void (*destroy)(void *c);
+} Container;
+
+/**
+ * Work given to one thread.
+ */
+typedef struct Worker {
+    /** The container being measured */
+    const Container *container;
+    /** The shared instance of the container */
+    void *c;
+    /** Keys are drawn from [0, range) */
+    uint64_t range;
+    /** Number of operations to run */
+    size_t ops;
+    /** Fraction of operations that are lookups, scaled to 2^32 */
+    uint64_t reads;
+    /** State of the thread's xorshift generator */
+    uint64_t seed;
+    /** Lets every thread start at once */
+    pthread_barrier_t *start;
+} Worker;
+
+static void *avlCreate(void) {
+    AVLTreeOptions options = { .arena = true, .concurrent = true };
+    return createAVLTreeWithOptions(&options);
+}
+static bool avlInsert(int k, void *v, void *c) { return insert_avl(k, v, c); }
+static void *avlLookup(int k, void *c) { return lookup_avl(k, c); }
+static void *avlDelete(int k, void *c) { return delete_avl(k, c); }
+static void avlDestroy(void *c) { freeTree(c); }
+
+static void *skipCreate(void) { return createSkipList(); }
+static bool skipInsert(int k, void *v, void *c) {
+    return insert_skiplist(k, v, c);
+}
+static void *skipLookup(int k, void *c) { return lookup_skiplist(k, c); }
+static void *skipDelete(int k, void *c) { return delete_skiplist(k, c); }
+static void skipDestroy(void *c) { freeSkipList(c); }
+
+/** Every container measured, in the order they are printed */
+static const Container containers[] = {
+    { "avl (locked)", avlCreate, avlInsert, avlLookup, avlDelete,
+      avlDestroy },
+    { "skiplist", skipCreate, skipInsert, skipLookup, skipDelete,
+      skipDestroy },
+};
+
+/** Number of containers */
+#define CONTAINERS (sizeof(containers) / sizeof(containers[0]))
+
+/* Static function prototypes */
+static uint64_t next_random(uint64_t *state);
+static double now_seconds(void);
+static void *run_worker(void *arg);
+static double measure(const Container *container, size_t n, size_t m,
+                      double reads, int threads);
+
+/**
+ * Runs every container at every thread count and prints the results.
+ */
+int main(int argc, char **argv) {
+    size_t n = DEFAULT_KEYS;
+    size_t m = DEFAULT_OPS;
+    double reads = DEFAULT_READS;
+    int maxThreads = DEFAULT_THREADS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:r:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = strtoull(optarg, NULL, 10);
+            break;
+        case 'm':
+            m = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            reads = strtod(optarg, NULL);
+            break;
+        case 't':
+            maxThreads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n keys] [-m ops] [-r reads] "
+                    "[-t threads]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (n == 0 || n > INT32_MAX / 2 || maxThreads < 1) {
+        fprintf(stderr, "key count must be between 1 and %d and there must "
+                "be at least one thread\n", INT32_MAX / 2);
+        return EXIT_FAILURE;
+    }
+
+    printf("%zu keys, %zu ops, %.0f%% lookups, %ld cpus\n", n, m,
+           reads * 100, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s", "threads");
+    for (size_t i = 0; i < CONTAINERS; i++) {
+        printf("%16s", containers[i].name);
+    }
+    printf("   (Mops/sec)\n");
+
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        printf("%-8d", threads);
+        for (size_t i = 0; i < CONTAINERS; i++) {
+            double rate = measure(&containers[i], n, m, reads, threads);
+            if (rate < 0) {
+                printf("\nout of memory\n");
+                return EXIT_FAILURE;
+            }
+            printf("%16.2f", rate / 1e6);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Loads a fresh container and times the threads sharing it.
+ *
+ * @param *container the container to measure
+ * @param n number of keys to load
+ * @param m number of operations shared by the threads
+ * @param reads fraction of operations that are lookups
+ * @param threads number of threads
+ *
+ * @return operations per second, or -1 if allocation fails
+ */
+static double measure(const Container *container, size_t n, size_t m,
+                      double reads, int threads) {
+    void *c = container->create();
+    Worker *workers = malloc(threads * sizeof(Worker));
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    if (c == NULL || workers == NULL || ids == NULL) {
+        free(ids);
+        free(workers);
+        if (c) {
+            container->destroy(c);
+        }
+        return -1;
+    }
+
+    /* Keys come from twice the range loaded, so inserts and deletes both
+        find work */
+    uint64_t state = 88172645463325252ULL;
+    for (size_t i = 0; i < n; i++) {
+        int key = (int) (next_random(&state) % (2 * n));
+        container->insert(key, &workers[0], c);
+    }
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker) {
+            .container = container, .c = c, .range = 2 * n,
+            .ops = m / threads + (i < (int) (m % threads)),
+            .reads = (uint64_t) (reads * 4294967296.0),
+            .seed = 0x9E3779B97F4A7C15ULL * (i + 1), .start = &start };
+        pthread_create(&ids[i], NULL, run_worker, &workers[i]);
+    }
+    pthread_barrier_wait(&start);
+    double began = now_seconds();
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double seconds = now_seconds() - began;
+
+    pthread_barrier_destroy(&start);
+    container->destroy(c);
+    free(ids);
+    free(workers);
+    return m / seconds;
+}
+
+/**
+ * Runs one thread's share of the operations.
+ *
+ * @param *arg the thread's Worker
+ */
+static void *run_worker(void *arg) {
+    Worker *worker = arg;
+    const Container *container = worker->container;
+    pthread_barrier_wait(worker->start);
+    for (size_t i = 0; i < worker->ops; i++) {
+        uint64_t r = next_random(&worker->seed);
+        int key = (int) ((r >> 32) % worker->range);
+        uint64_t pick = r & 0xFFFFFFFF;
+        if (pick < worker->reads) {
+            container->lookup(key, worker->c);
+        } else if (pick & 1) {
+            container->insert(key, worker, worker->c);
+        } else {
+            container->delete(key, worker->c);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns the next number from a xorshift generator.
+ *
+ * @param *state the generator's state
+ */
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Returns a monotonic timestamp in seconds.
+ */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,378 @@
+/**
+ * @file workload.c
+ * @author Brian Gillespie
+ *
+ * Throughput and latency harness for the AVL tree. Loads N keys, then
+ * runs M operations drawn from one of several workloads, timing every
+ * operation. Reports operations per second, latency percentiles,
+ * rotations per insert and peak resident memory, so that changes to the
+ * tree can be measured against plain insert_avl and lookup_avl.
+ *
+ * Workloads:
+ *   seq     keys are loaded and then looked up in ascending order
+ *   random  keys are loaded in random order, lookups are uniform
+ *   zipf    keys are loaded in random order, lookups are Zipf-distributed
+ *   mixed   Zipf-distributed keys, a fraction of reads and otherwise an
+ *           even split of inserts and deletes
+ *
+ * Usage: workload [-w workload] [-n keys] [-m ops] [-r read fraction]
+ *                 [-s zipf skew] [-c cache slots] [-k imbalance] [-a]
+ *                 [-p]
+ *
+ * -a carves nodes out of an arena instead of calling malloc for each.
+ * -p loads the seq workload with avl_append instead of insert_avl.
+ * -c puts a lookup cache of about that many slots in front of the tree.
+ * -k lets sibling subtrees differ in height by up to that much.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "avl.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Default number of keys to load */
+#define DEFAULT_KEYS 1000000
+
+/** Default number of operations to run after loading */
+#define DEFAULT_OPS 2000000
+
+/** Default fraction of reads in the mixed workload */
+#define DEFAULT_READS 0.9
+
+/** Default skew of the Zipf distribution */
+#define DEFAULT_SKEW 0.99
+
+/** Workloads the harness can run */
+typedef enum Workload { SEQUENTIAL, RANDOM, ZIPF, MIXED } Workload;
+
+/** Names of the workloads, indexed by Workload */
+static const char *const workloadNames[] = { "seq", "random", "zipf",
+                                             "mixed" };
+
+/**
+ * State for drawing ranks from a Zipf distribution, using the method of
+ * Gray et al., "Quickly Generating Billion-Record Synthetic Databases".
+ */
+typedef struct Zipf {
+    /** Number of ranks */
+    size_t n;
+    /** Skew parameter */
+    double theta;
+    /** 1 / (1 - theta) */
+    double alpha;
+    /** Generalized harmonic number of n */
+    double zetan;
+    /** Constant from the method, derived from the others */
+    double eta;
+} Zipf;
+
+/**
+ * Latencies of one phase, in nanoseconds.
+ */
+typedef struct Samples {
+    /** One latency per operation */
+    uint32_t *ns;
+    /** Number of latencies recorded */
+    size_t count;
+    /** Wall time of the whole phase */
+    double seconds;
+} Samples;
+
+/* Static function prototypes */
+static uint64_t next_random(void);
+static double next_unit(void);
+static void zipf_init(Zipf *zipf, size_t n, double theta);
+static size_t zipf_next(const Zipf *zipf);
+static uint64_t now_ns(void);
+static int compare_u32(const void *a, const void *b);
+static void report(const char *phase, Samples *samples);
+
+/** State of the xorshift generator */
+static uint64_t randomState = 88172645463325252ULL;
+
+/**
+ * Runs the selected workload and prints the results.
+ */
+int main(int argc, char **argv) {
+    Workload workload = RANDOM;
+    size_t n = DEFAULT_KEYS;
+    size_t m = DEFAULT_OPS;
+    double reads = DEFAULT_READS;
+    double skew = DEFAULT_SKEW;
+    size_t cacheSlots = 0;
+    int imbalance = 1;
+    bool arena = false;
+    bool append = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:n:m:r:s:c:k:ap")) != -1) {
+        switch (opt) {
+        case 'w':
+            for (workload = SEQUENTIAL; workload <= MIXED; workload++) {
+                if (strcmp(optarg, workloadNames[workload]) == 0) {
+                    break;
+                }
+            }
+            if (workload > MIXED) {
+                fprintf(stderr, "unknown workload %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            n = strtoull(optarg, NULL, 10);
+            break;
+        case 'm':
+            m = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            reads = strtod(optarg, NULL);
+            break;
+        case 's':
+            skew = strtod(optarg, NULL);
+            break;
+        case 'c':
+            cacheSlots = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            imbalance = atoi(optarg);
+            break;
+        case 'a':
+            arena = true;
+            break;
+        case 'p':
+            append = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-w seq|random|zipf|mixed] [-n keys] "
+                    "[-m ops] [-r reads] [-s skew] [-c slots] "
+                    "[-k imbalance] [-a] [-p]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (append && workload != SEQUENTIAL) {
+        fprintf(stderr, "-p needs keys in ascending order, so only the seq "
+                "workload can use it\n");
+        return EXIT_FAILURE;
+    }
+    if (n == 0 || n > INT32_MAX / 2) {
+        fprintf(stderr, "key count must be between 1 and %d\n",
+                INT32_MAX / 2);
+        return EXIT_FAILURE;
+    }
+
+    /* Keys are spread out so the mixed workload can insert keys that are
+        not loaded. Every other workload loads all of them. */
+    int *keys = malloc(n * sizeof(int));
+    Samples load = { .ns = malloc(n * sizeof(uint32_t)) };
+    Samples run = { .ns = malloc(m * sizeof(uint32_t) + 1) };
+    if (keys == NULL || load.ns == NULL || run.ns == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = (int) (2 * i);
+    }
+    if (workload != SEQUENTIAL) {
+        for (size_t i = n - 1; i > 0; i--) {
+            size_t j = next_random() % (i + 1);
+            int swap = keys[i];
+            keys[i] = keys[j];
+            keys[j] = swap;
+        }
+    }
+    Zipf zipf = { .n = 0 };
+    if (workload == ZIPF || workload == MIXED) {
+        zipf_init(&zipf, n, skew);
+    }
+
+    AVLTreeOptions options = { .arena = arena, .cacheSlots = cacheSlots,
+                               .maxImbalance = imbalance };
+    AVLTree *tree = createAVLTreeWithOptions(&options);
+    if (tree == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+    printf("workload %s, %zu keys, %zu ops%s", workloadNames[workload],
+           n, m, arena ? ", arena" : "");
+    if (cacheSlots > 0) {
+        printf(", %zu cache slots", cacheSlots);
+    }
+    if (imbalance > 1) {
+        printf(", imbalance %d", imbalance);
+    }
+    if (append) {
+        printf(", append");
+    }
+    printf("\n");
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        if (append) {
+            avl_append(tree, keys[i], &keys[i]);
+        } else {
+            insert_avl(keys[i], &keys[i], tree);
+        }
+        load.ns[load.count++] = (uint32_t) (now_ns() - t);
+    }
+    load.seconds = (now_ns() - start) / 1e9;
+    struct avl_stats stats;
+    bool counted = avl_stats(tree, &stats);
+    size_t loadRotations = stats.singleRotations + 2 * stats.doubleRotations;
+
+    size_t hits = 0;
+    start = now_ns();
+    for (size_t i = 0; i < m; i++) {
+        size_t rank;
+        if (workload == SEQUENTIAL) {
+            rank = i % n;
+        } else if (workload == RANDOM) {
+            rank = next_random() % n;
+        } else {
+            rank = zipf_next(&zipf);
+        }
+        // In the mixed workload writes move keys off and on the odd slots
+        int key = keys[rank];
+        uint64_t t;
+        if (workload == MIXED && next_unit() >= reads) {
+            key |= next_random() & 1;
+            t = now_ns();
+            if (next_random() & 1) {
+                insert_avl(key, &keys[rank], tree);
+            } else {
+                delete_avl(key, tree);
+            }
+        } else {
+            t = now_ns();
+            hits += lookup_avl(key, tree) != NULL;
+        }
+        run.ns[run.count++] = (uint32_t) (now_ns() - t);
+    }
+    run.seconds = (now_ns() - start) / 1e9;
+
+    report("load", &load);
+    report(workload == MIXED ? "mixed" : "lookup", &run);
+    if (counted) {
+        avl_stats(tree, &stats);
+        printf("rotations per insert %.3f, average depth %.2f, "
+               "max depth %zu\n", (double) loadRotations / n,
+               stats.averageDepth, stats.maxDepth);
+    } else {
+        printf("rotations per insert n/a (build with -DAVL_STATS)\n");
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("peak rss %.1f MB, %zu lookup hits, %zu keys at end\n",
+           usage.ru_maxrss / 1024.0, hits, tree->count);
+
+    freeTree(tree);
+    free(run.ns);
+    free(load.ns);
+    free(keys);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Returns the next number from a xorshift generator.
+ */
+static uint64_t next_random(void) {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+/**
+ * Returns a random number in [0, 1).
+ */
+static double next_unit(void) {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Prepares to draw ranks in [0, n) where rank i has weight 1 / (i+1)^theta.
+ *
+ * @param *zipf the distribution to set up
+ * @param n number of ranks
+ * @param theta skew, between 0 and 1 exclusive
+ */
+static void zipf_init(Zipf *zipf, size_t n, double theta) {
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->zetan = 0;
+    for (size_t i = 1; i <= n; i++) {
+        zipf->zetan += pow(1.0 / i, theta);
+    }
+    double zeta2 = 1.0 + pow(0.5, theta);
+    zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) /
+                (1.0 - zeta2 / zipf->zetan);
+}
+
+/**
+ * Draws a rank from a Zipf distribution. Rank 0 is the most popular.
+ *
+ * @param *zipf the distribution to draw from
+ *
+ * @return a rank in [0, n)
+ */
+static size_t zipf_next(const Zipf *zipf) {
+    double u = next_unit();
+    double uz = u * zipf->zetan;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, zipf->theta)) {
+        return zipf->n > 1 ? 1 : 0;
+    }
+    size_t rank = (size_t) (zipf->n *
+                            pow(zipf->eta * u - zipf->eta + 1.0,
+                                zipf->alpha));
+    return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+/**
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Orders latencies for qsort.
+ */
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Prints the throughput and latency percentiles of a phase. Sorts the
+ * samples in place.
+ *
+ * @param *phase name of the phase
+ * @param *samples latencies recorded during the phase
+ */
+static void report(const char *phase, Samples *samples) {
+    if (samples->count == 0) {
+        printf("%-7s no operations\n", phase);
+        return;
+    }
+    qsort(samples->ns, samples->count, sizeof(uint32_t), compare_u32);
+    size_t last = samples->count - 1;
+    printf("%-7s %12.0f ops/sec   p50 %6u ns   p99 %6u ns   "
+           "p999 %6u ns\n", phase, samples->count / samples->seconds,
+           samples->ns[last / 2], samples->ns[last * 99 / 100],
+           samples->ns[last * 999 / 1000]);
+}